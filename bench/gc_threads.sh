@@ -0,0 +1,24 @@
+#!/bin/sh
+# mark and sweep time of full collections against heap size and gc threads,
+# read from the --stats metrics, needs an interpreter built with PARALLEL_GC
+#   bench/gc_threads.sh build/interpreter
+set -e
+clox=${1:-build/interpreter}
+dir=$(dirname "$0")
+script=$(mktemp)
+trap 'rm -f "$script"' EXIT
+
+for depth in 14 16 18; do
+  sed "s/^var maxDepth = .*;/var maxDepth = $depth;/" "$dir/binary_trees.lox" \
+    >"$script"
+  for threads in 1 2 4 8; do
+    times=$("$clox" --gc-threads=$threads --stats=- "$script" |
+      sed -n 's/^ *"\(mark\|sweep\)Ms": \([0-9.]*\),$/\1 \2ms/p' |
+      paste -sd, - | sed "s/,/, /")
+    if [ -z "$times" ]; then
+      echo "no mark and sweep times in the --stats output of $clox" >&2
+      exit 1
+    fi
+    echo "depth $depth, $threads threads: $times"
+  done
+done
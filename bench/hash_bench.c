@@ -0,0 +1,114 @@
+// hashing and interning throughput, built with -DCLOX_BENCHMARKS=ON
+//   ./hash_bench
+// compares the string hash against the byte at a time FNV-1a it replaced on
+// short identifiers and long strings, then interns identifiers through
+// copyString
+
+#include "hash.h"
+#include "object.h"
+#include "vm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SHORT_COUNT 4096
+#define SHORT_ROUNDS 2000
+#define LONG_LENGTH (64 * 1024)
+#define LONG_ROUNDS 20000
+
+static uint32_t fnv1a(const char *key, int length) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < length; i++) {
+    hash ^= (uint8_t)key[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+typedef uint32_t (*HashFn)(const char *key, int length);
+
+static double elapsed(clock_t start) {
+  return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+// identifiers like the ones a scanner hands to copyString, 3 to 16 chars
+static char shortKeys[SHORT_COUNT][17];
+static int shortLengths[SHORT_COUNT];
+
+static void makeShortKeys() {
+  srand(42);
+  for (int i = 0; i < SHORT_COUNT; i++) {
+    int length = 3 + rand() % 14;
+    for (int j = 0; j < length; j++) {
+      shortKeys[i][j] = "abcdefghijklmnopqrstuvwxyz_0123456789"[rand() % 37];
+    }
+    shortKeys[i][length] = '\0';
+    shortLengths[i] = length;
+  }
+}
+
+// the sink keeps the compiler from dropping the hash calls
+static volatile uint32_t sink;
+
+static void benchShort(const char *name, HashFn hash) {
+  uint32_t acc = 0;
+  clock_t start = clock();
+  for (int round = 0; round < SHORT_ROUNDS; round++) {
+    for (int i = 0; i < SHORT_COUNT; i++) {
+      acc += hash(shortKeys[i], shortLengths[i]);
+    }
+  }
+  double seconds = elapsed(start);
+  sink = acc;
+  printf("%-8s short  %7.2f ns/key\n", name,
+         seconds * 1e9 / ((double)SHORT_ROUNDS * SHORT_COUNT));
+}
+
+static void benchLong(const char *name, HashFn hash, const char *buffer) {
+  uint32_t acc = 0;
+  clock_t start = clock();
+  for (int round = 0; round < LONG_ROUNDS; round++) {
+    acc += hash(buffer, LONG_LENGTH - round % 8);
+  }
+  double seconds = elapsed(start);
+  sink = acc;
+  printf("%-8s long   %7.2f GB/s\n", name,
+         (double)LONG_ROUNDS * LONG_LENGTH / seconds / 1e9);
+}
+
+static void benchIntern() {
+  initVm();
+  // the first pass inserts every identifier, the second finds them all
+  for (int pass = 0; pass < 2; pass++) {
+    clock_t start = clock();
+    for (int round = 0; round < (pass == 0 ? 1 : SHORT_ROUNDS / 10); round++) {
+      for (int i = 0; i < SHORT_COUNT; i++) {
+        ObjString *string = copyString(shortKeys[i], shortLengths[i]);
+        sink += string->length;
+      }
+    }
+    double seconds = elapsed(start);
+    int count = (pass == 0 ? 1 : SHORT_ROUNDS / 10) * SHORT_COUNT;
+    printf("intern   %-6s %7.2f ns/key\n", pass == 0 ? "insert" : "lookup",
+           seconds * 1e9 / count);
+  }
+  freeVm();
+}
+
+int main() {
+  makeShortKeys();
+  char *buffer = malloc(LONG_LENGTH);
+  for (int i = 0; i < LONG_LENGTH; i++) {
+    buffer[i] = (char)('a' + i % 26);
+  }
+
+  benchShort("fnv1a", fnv1a);
+  benchShort("wyhash", hashBytes);
+  benchLong("fnv1a", fnv1a, buffer);
+  benchLong("wyhash", hashBytes, buffer);
+  benchIntern();
+
+  free(buffer);
+  return 0;
+}
@@ -11,6 +11,8 @@ void initChunk(Chunk *chunk) {
   chunk->count = 0;
   chunk->code = NULL;
   chunk->lines = NULL;
+  chunk->hits = NULL;
+  chunk->cycles = NULL;
   initValueArray(&chunk->constants);
 }
 
@@ -31,10 +33,174 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line) {
 void freeChunk(Chunk *chunk) {
   FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
   FREE_ARRAY(int, chunk->lines, chunk->capacity);
+  free(chunk->hits);
+  free(chunk->cycles);
   freeValueArray(&chunk->constants);
   initChunk(chunk);
 }
 
+int instructionSize(Chunk *chunk, int offset) {
+  switch (chunk->code[offset]) {
+  case OP_CONSTANT:
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_CALL:
+  case OP_TAIL_CALL:
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+    return 2;
+  case OP_DEFINE_GLOBAL:
+  case OP_GET_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_LOOP:
+  case OP_POP_JUMP_IF_FALSE:
+  case OP_JUMP_IF_NOT_EQUAL:
+  case OP_JUMP_IF_EQUAL:
+  case OP_JUMP_IF_NOT_LESS:
+  case OP_JUMP_IF_NOT_LESS_EQUAL:
+  case OP_JUMP_IF_NOT_GREATER:
+  case OP_JUMP_IF_NOT_GREATER_EQUAL:
+  case OP_GET_LOCAL_2:
+  case OP_ADD_LOCAL_CONST:
+  case OP_SUBTRACT_LOCAL_CONST:
+    return 3;
+  case OP_CLOSURE: {
+    // constant index followed by an (isLocal, index) pair per upvalue
+    ObjFunction *function =
+        AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+    return 2 + function->upvalueCount * 2;
+  }
+  default:
+    return 1;
+  }
+}
+
+// values the instruction at offset leaves on the stack less the ones it
+// takes, *peak is how far above the depth it started from it goes meanwhile
+static int stackEffect(Chunk *chunk, int offset, int *peak) {
+  *peak = 0;
+  switch (chunk->code[offset]) {
+  case OP_CONSTANT:
+  case OP_NIL:
+  case OP_FALSE:
+  case OP_TRUE:
+  case OP_GET_GLOBAL:
+  case OP_GET_LOCAL:
+  case OP_CLOSURE:
+  case OP_GET_UPVALUE:
+  case OP_SUBTRACT_LOCAL_CONST:
+    *peak = 1;
+    return 1;
+  case OP_ADD_LOCAL_CONST:
+    // the slow path pushes both operands before adding them
+    *peak = 2;
+    return 1;
+  case OP_GET_LOCAL_2:
+    *peak = 2;
+    return 2;
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULT:
+  case OP_DIVIDE:
+  case OP_EQUAL:
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_PRINT:
+  case OP_POP:
+  case OP_DEFINE_GLOBAL:
+  case OP_CLOSE_UPVALUE:
+  case OP_RETURN:
+  case OP_NOT_EQUAL:
+  case OP_LESS_EQUAL:
+  case OP_GREATER_EQUAL:
+  case OP_POP_JUMP_IF_FALSE:
+  case OP_ADD_NUM:
+  case OP_ADD_STR:
+  case OP_EQUAL_NUM:
+    return -1;
+  case OP_JUMP_IF_NOT_EQUAL:
+  case OP_JUMP_IF_EQUAL:
+  case OP_JUMP_IF_NOT_LESS:
+  case OP_JUMP_IF_NOT_LESS_EQUAL:
+  case OP_JUMP_IF_NOT_GREATER:
+  case OP_JUMP_IF_NOT_GREATER_EQUAL:
+    return -2;
+  case OP_CALL:
+  case OP_TAIL_CALL:
+    // the callee and its arguments are replaced with the result, the callee
+    // reserves its own slots
+    return -chunk->code[offset + 1];
+  default:
+    return 0;
+  }
+}
+
+// the offset the instruction at offset may jump to, -1 for the rest
+static int jumpTarget(Chunk *chunk, int offset) {
+  uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8) |
+                  chunk->code[offset + 2];
+  switch (chunk->code[offset]) {
+  case OP_LOOP:
+    return offset + 3 - jump;
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_POP_JUMP_IF_FALSE:
+  case OP_JUMP_IF_NOT_EQUAL:
+  case OP_JUMP_IF_EQUAL:
+  case OP_JUMP_IF_NOT_LESS:
+  case OP_JUMP_IF_NOT_LESS_EQUAL:
+  case OP_JUMP_IF_NOT_GREATER:
+  case OP_JUMP_IF_NOT_GREATER_EQUAL:
+    return offset + 3 + jump;
+  default:
+    return -1;
+  }
+}
+
+int maxStackDepth(Chunk *chunk, int depth) {
+  // depth before each instruction, -1 until a path reaches it, the compiler
+  // keeps it the same on every path, so each offset is visited once
+  int *depths = (int *)malloc(sizeof(int) * chunk->count);
+  int *pending = (int *)malloc(sizeof(int) * chunk->count);
+  if (depths == NULL || pending == NULL) {
+    exit(1);
+  }
+  for (int i = 0; i < chunk->count; i++) {
+    depths[i] = -1;
+  }
+
+  int maxDepth = depth;
+  int pendingCount = 0;
+  depths[0] = depth;
+  pending[pendingCount++] = 0;
+  while (pendingCount > 0) {
+    int offset = pending[--pendingCount];
+    int peak;
+    int after = depths[offset] + stackEffect(chunk, offset, &peak);
+    if (depths[offset] + peak > maxDepth) {
+      maxDepth = depths[offset] + peak;
+    }
+
+    uint8_t op = chunk->code[offset];
+    int next[2] = {-1, jumpTarget(chunk, offset)};
+    if (op != OP_RETURN && op != OP_JUMP && op != OP_LOOP) {
+      next[0] = offset + instructionSize(chunk, offset);
+    }
+    for (int i = 0; i < 2; i++) {
+      if (next[i] >= 0 && next[i] < chunk->count && depths[next[i]] < 0) {
+        depths[next[i]] = after;
+        pending[pendingCount++] = next[i];
+      }
+    }
+  }
+
+  free(depths);
+  free(pending);
+  return maxDepth;
+}
+
 int addConstant(Chunk *chunk, Value value) {
   push(value);
   writeValueArray(&chunk->constants, value);
@@ -34,20 +34,50 @@ typedef enum {
   OP_GET_UPVALUE,
   OP_SET_UPVALUE,
   OP_CLOSE_UPVALUE,
-  
+  OP_TAIL_CALL,
+  // superinstructions, only produced by the peephole pass
+  OP_NOT_EQUAL,
+  OP_LESS_EQUAL,
+  OP_GREATER_EQUAL,
+  OP_POP_JUMP_IF_FALSE,
+  OP_JUMP_IF_NOT_EQUAL,
+  OP_JUMP_IF_EQUAL,
+  OP_JUMP_IF_NOT_LESS,
+  OP_JUMP_IF_NOT_LESS_EQUAL,
+  OP_JUMP_IF_NOT_GREATER,
+  OP_JUMP_IF_NOT_GREATER_EQUAL,
+  OP_GET_LOCAL_2,
+  OP_ADD_LOCAL_CONST,
+  OP_SUBTRACT_LOCAL_CONST,
+  // specialized forms, run() rewrites the generic instruction in place once
+  // it has seen the operand types
+  OP_ADD_NUM,
+  OP_ADD_STR,
+  OP_EQUAL_NUM,
 } OpCode;
 
+// keep it after the last opcode
+#define OP_COUNT (OP_EQUAL_NUM + 1)
+
 typedef struct {
   int count;
   int capacity;
   uint8_t *code;
   ValueArray constants;
   int *lines;
+  // executions and cycles of the instruction at each offset, made once run()
+  // first counts an instruction of the chunk, see --count
+  uint64_t *hits;
+  uint64_t *cycles;
 } Chunk;
 
 void initChunk(Chunk *chunk);
 void freeChunk(Chunk *chunk);
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
 int addConstant(Chunk *chunk, Value value);
+int instructionSize(Chunk *chunk, int offset);
+// the most values a finished chunk holds on the stack at once, depth is what
+// it starts with
+int maxStackDepth(Chunk *chunk, int depth);
 
 #endif
@@ -9,6 +9,79 @@
 // #define DEBUG_PRINT_CODE
 // #define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
-#define DEBUG_LOG_STATS_GC
+
+// pack every Value into a single 64-bit word, comment out to get the tagged
+// union representation back
+#define NAN_BOXING
+
+// strings produced by the running program skip the intern pool and hash
+// lazily, they are interned only once used as a key, comment out to intern
+// every string on creation
+#define LAZY_INTERNING
+
+// HashTable keeps one control byte per slot with a fragment of the key hash
+// and probes them a group at a time, comment out to get the linear probing
+// table back
+#define SWISS_TABLE
+
+// objects and the arrays they own come from size-class slabs carved out of
+// pages, big ones from pages of their own, comment out to use malloc for
+// everything
+#define SLAB_ALLOCATOR
+
+// objects made while a script runs are bump allocated in a nursery, minor
+// collections copy the survivors into the mark-sweep heap, uncomment to
+// enable
+// #define GENERATIONAL_GC
+
+// collections run as bounded slices of marking and sweeping interleaved with
+// allocation instead of one stop-the-world pass, uncomment to enable
+// #define INCREMENTAL_GC
+
+// with INCREMENTAL_GC, marking runs on a helper thread while the script keeps
+// going, only sweeping is still done in slices, uncomment to enable
+// #define CONCURRENT_GC
+
+// full collections trace the heap with several threads that steal gray
+// objects from each other, then sweep the heap segments between them, set
+// their number with --gc-threads, uncomment to enable
+// #define PARALLEL_GC
+
+// full collections only mark, the heap segments are swept afterwards a few at
+// a time by the allocations that need memory, uncomment to enable
+// #define LAZY_SWEEP
+
+// once a full collection leaves the slabs fragmented, the next safepoint in
+// run() moves the objects out of the sparse slabs and fixes every reference
+// to them, so the emptied slabs go back to the os, uncomment to enable
+// #define COMPACTING_GC
+
+#if defined(GENERATIONAL_GC) && defined(INCREMENTAL_GC)
+#error "GENERATIONAL_GC and INCREMENTAL_GC can't be combined"
+#endif
+#if defined(CONCURRENT_GC) && !defined(INCREMENTAL_GC)
+#error "CONCURRENT_GC needs INCREMENTAL_GC"
+#endif
+#if defined(PARALLEL_GC) && defined(INCREMENTAL_GC)
+#error "PARALLEL_GC and INCREMENTAL_GC can't be combined"
+#endif
+#if defined(LAZY_SWEEP) && defined(INCREMENTAL_GC)
+#error "INCREMENTAL_GC already sweeps in slices, drop LAZY_SWEEP"
+#endif
+#if defined(COMPACTING_GC) && !defined(SLAB_ALLOCATOR)
+#error "COMPACTING_GC moves objects between slabs, it needs SLAB_ALLOCATOR"
+#endif
+#if defined(COMPACTING_GC) && defined(INCREMENTAL_GC)
+#error "COMPACTING_GC and INCREMENTAL_GC can't be combined"
+#endif
+#if defined(PARALLEL_GC) && !defined(__GNUC__)
+#error "PARALLEL_GC needs the __atomic builtins"
+#endif
+
+// threaded dispatch in run() relies on the labels-as-values extension, build
+// with -DNO_COMPUTED_GOTO to get the portable switch loop instead
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
 
 #endif
@@ -2,9 +2,12 @@
 #include "chunk.h"
 #include "debug.h"
 #include "memory.h"
+#include "metrics.h"
 #include "object.h"
+#include "peephole.h"
 #include "scanner.h"
 #include "value.h"
+#include "vm.h"
 #include <_types/_uint8_t.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -37,6 +40,8 @@ typedef struct Compiler {
   Upvalue upvalues[UINT8_COUNT];
   int localCount;
   int scopeDepth;
+  // offset of the last OP_CALL emitted, lets return turn it into a tail call
+  int lastCall;
 } Compiler;
 
 Parser parser;
@@ -73,12 +78,14 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
 
   compiler->localCount = 0;
   compiler->scopeDepth = 0;
+  compiler->lastCall = -1;
   compiler->function = newFunction();
   current = compiler;
 
   if (type != TYPE_SCRIPT) {
-    current->function->name =
-        copyString(parser.previous.start, parser.previous.length);
+    ObjString *name = copyString(parser.previous.start, parser.previous.length);
+    WRITE_BARRIER(&current->function->obj, OBJ_VAL(name));
+    current->function->name = name;
   }
 
   Local *local = &current->locals[current->localCount++];
@@ -113,6 +120,11 @@ static void errorAtPrevius(const char *message) {
 }
 
 static void advance() {
+  static int untimedTokens = 0;
+  bool timed = untimedTokens == 0;
+  untimedTokens = timed ? SCAN_SAMPLE_INTERVAL - 1 : untimedTokens - 1;
+  double start = timed ? metricsClock() : 0;
+
   parser.previous = parser.current;
   for (;;) {
     parser.current = scanToken();
@@ -121,6 +133,9 @@ static void advance() {
     }
     errorAtCurrent(parser.current.start);
   }
+  if (timed) {
+    vm.metrics.scanTime += (metricsClock() - start) * SCAN_SAMPLE_INTERVAL;
+  }
 }
 
 static bool identifiersEqual(Token *a, Token *b) {
@@ -221,6 +236,7 @@ static void endScope() {
 }
 
 static uint8_t makeConstant(Value value) {
+  WRITE_BARRIER(&current->function->obj, value);
   int constants = addConstant(getCurrentChunk(), value);
   if (constants > UINT8_MAX) {
     errorAtPrevius("Too many constants in one chunk.");
@@ -236,16 +252,31 @@ static void markInitialized() {
   current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static void defineVariable(uint8_t variableIdx) {
+static void emitGlobal(uint8_t instruction, uint16_t slot) {
+  // GLOBAL_INSTRUCTION
+  // SLOT 8 MSB
+  // SLOT 8 LSB
+  emitByte(instruction);
+  emitByte((slot >> 8) & 0xff);
+  emitByte(slot & 0xff);
+}
+
+static void defineVariable(uint16_t variableIdx) {
   if (current->scopeDepth > 0) {
     markInitialized();
     return;
   }
-  emitBytes(OP_DEFINE_GLOBAL, variableIdx);
+  emitGlobal(OP_DEFINE_GLOBAL, variableIdx);
 }
 
-static uint8_t identifierConstant(Token *token) {
-  return makeConstant(OBJ_VAL(copyString(token->start, token->length)));
+static uint16_t identifierGlobal(Token *token) {
+  int slot = resolveGlobal(copyString(token->start, token->length));
+  if (slot > UINT16_MAX) {
+    errorAtPrevius("Too many global variables.");
+    return 0;
+  }
+
+  return (uint16_t)slot;
 }
 
 static void addLocal(Token name) {
@@ -277,13 +308,13 @@ static void declareVariable() {
   addLocal(*name);
 }
 
-static uint8_t parseVariable(char *errorMessage) {
+static uint16_t parseVariable(char *errorMessage) {
   consume(TOKEN_IDENTIFIER, errorMessage);
   declareVariable();
   if (current->scopeDepth > 0)
     return 0;
 
-  return identifierConstant(&parser.previous);
+  return identifierGlobal(&parser.previous);
 }
 
 static void emitConstant(Value value) {
@@ -298,6 +329,10 @@ static void emitReturn() {
 static ObjFunction *endCompiler() {
   emitReturn();
   ObjFunction *function = current->function;
+  if (parser.isOk) {
+    peepholeOptimize(&function->chunk);
+    function->maxStack = maxStackDepth(&function->chunk, function->arity + 1);
+  }
 #ifdef DEBUG_PRINT_CODE
   if (parser.isOk) {
     disassembleChunk(getCurrentChunk(), current->function->name != NULL
@@ -398,6 +433,7 @@ static uint8_t argumentList() {
 
 static void call(bool canAssign) {
   uint8_t argCount = argumentList();
+  current->lastCall = getCurrentChunk()->count;
   emitBytes(OP_CALL, argCount);
 }
 
@@ -481,16 +517,21 @@ static void namedVariable(Token name, bool canAssign) {
     getOp = OP_GET_UPVALUE;
     setOp = OP_SET_UPVALUE;
   } else {
-    arg = identifierConstant(&name);
+    arg = identifierGlobal(&name);
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
   }
+  uint8_t op = getOp;
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
-    emitBytes(setOp, (uint8_t)arg);
+    op = setOp;
+  }
+  // global slots don't fit into a single byte operand
+  if (op == OP_GET_GLOBAL || op == OP_SET_GLOBAL) {
+    emitGlobal(op, (uint16_t)arg);
     return;
   }
-  emitBytes(getOp, (uint8_t)arg);
+  emitBytes(op, (uint8_t)arg);
 }
 
 static void variable(bool canAssign) {
@@ -589,7 +630,7 @@ static void function(FunctionType type) {
       if (current->function->arity > 255) {
         errorAtCurrent("Can't have more than 255 parameters.");
       }
-      uint8_t constant = parseVariable("Expect parameter name.");
+      uint16_t constant = parseVariable("Expect parameter name.");
       defineVariable(constant);
     } while (match(TOKEN_COMMA));
   }
@@ -607,7 +648,7 @@ static void function(FunctionType type) {
 }
 
 static void functionDeclaration() {
-  uint8_t functionNameIdx = parseVariable("Expect function name.");
+  uint16_t functionNameIdx = parseVariable("Expect function name.");
   markInitialized();
   function(TYPE_FUNCTION);
   defineVariable(functionNameIdx);
@@ -615,7 +656,7 @@ static void functionDeclaration() {
 }
 
 static void varDeclaration() {
-  uint8_t variableIdx = parseVariable("Expect variable name.");
+  uint16_t variableIdx = parseVariable("Expect variable name.");
   if (match(TOKEN_EQUAL)) {
     expression();
   } else {
@@ -647,6 +688,12 @@ static void returnStatement() {
   } else {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+    // the call is the last thing the returned expression does, so the
+    // callee can take over this frame, the OP_RETURN after it is still
+    // needed for jumps that skip the call, like in `return a or f();`
+    if (current->lastCall == getCurrentChunk()->count - 2) {
+      getCurrentChunk()->code[current->lastCall] = OP_TAIL_CALL;
+    }
     emitByte(OP_RETURN);
   }
 }
@@ -2,8 +2,10 @@
 
 #include "chunk.h"
 #include "debug.h"
+#include "instruction_counts.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 static int simpleInstruction(const char *name, int offset) {
   printf("%s\n", name);
@@ -33,12 +35,119 @@ static int constantInstruction(const char *name, Chunk *chunk, int offset) {
   return offset + 2;
 }
 
-//
+static int globalInstruction(const char *name, Chunk *chunk, int offset) {
+  uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+  slot |= chunk->code[offset + 2];
+  printf("%-16s %4d '", name, slot);
+  printValue(vm.globalNames.values[slot]);
+  printf("'\n");
+
+  return offset + 3;
+}
+
+static int twoByteInstruction(const char *name, Chunk *chunk, int offset) {
+  uint8_t first = chunk->code[offset + 1];
+  uint8_t second = chunk->code[offset + 2];
+  printf("%-16s %4d %4d\n", name, first, second);
+  return offset + 3;
+}
+
+static int localConstantInstruction(const char *name, Chunk *chunk,
+                                    int offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint8_t constant = chunk->code[offset + 2];
+  printf("%-16s %4d %4d '", name, slot, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("'\n");
+  return offset + 3;
+}
+
+// room taken by the counts in front of every line, the lines OP_CLOSURE
+// prints for its upvalues are indented by the same amount
+static int annotationWidth = 0;
+
+// a chunk that ran with --count gets the executions of every instruction and
+// their share of all the instructions counted, and the cycles if they were
+// measured
+static void printAnnotation(Chunk *chunk, int offset) {
+  uint64_t hits = chunk->hits[offset];
+  if (hits == 0) {
+    printf("%*s", annotationWidth, "");
+    return;
+  }
+  printf("%12llu %5.1f%% ", (unsigned long long)hits,
+         hits * 100.0 / countedInstructions());
+  if (chunk->cycles != NULL) {
+    printf("%14llu %8.1f ", (unsigned long long)chunk->cycles[offset],
+           (double)chunk->cycles[offset] / hits);
+  }
+}
+
 void disassembleChunk(Chunk *chunk, const char *name) {
   printf("== %s ==\n", name);
+  if (chunk->hits != NULL) {
+    annotationWidth = chunk->cycles != NULL ? 44 : 20;
+  }
   for (int ofs = 0; ofs < chunk->count;) {
+    if (chunk->hits != NULL) {
+      printAnnotation(chunk, ofs);
+    }
     ofs = disassembleInstruction(chunk, ofs);
   }
+  annotationWidth = 0;
+}
+
+static const char *opcodeNames[OP_COUNT] = {
+    [OP_RETURN] = "OP_RETURN",
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_MULT] = "OP_MULT",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_NIL] = "OP_NIL",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_NOT] = "OP_NOT",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_POP] = "OP_POP",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_CALL] = "OP_CALL",
+    [OP_CLOSURE] = "OP_CLOSURE",
+    [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+    [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+    [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+    [OP_TAIL_CALL] = "OP_TAIL_CALL",
+    [OP_NOT_EQUAL] = "OP_NOT_EQUAL",
+    [OP_LESS_EQUAL] = "OP_LESS_EQUAL",
+    [OP_GREATER_EQUAL] = "OP_GREATER_EQUAL",
+    [OP_POP_JUMP_IF_FALSE] = "OP_POP_JUMP_IF_FALSE",
+    [OP_JUMP_IF_NOT_EQUAL] = "OP_JUMP_IF_NOT_EQUAL",
+    [OP_JUMP_IF_EQUAL] = "OP_JUMP_IF_EQUAL",
+    [OP_JUMP_IF_NOT_LESS] = "OP_JUMP_IF_NOT_LESS",
+    [OP_JUMP_IF_NOT_LESS_EQUAL] = "OP_JUMP_IF_NOT_LESS_EQUAL",
+    [OP_JUMP_IF_NOT_GREATER] = "OP_JUMP_IF_NOT_GREATER",
+    [OP_JUMP_IF_NOT_GREATER_EQUAL] = "OP_JUMP_IF_NOT_GREATER_EQUAL",
+    [OP_GET_LOCAL_2] = "OP_GET_LOCAL_2",
+    [OP_ADD_LOCAL_CONST] = "OP_ADD_LOCAL_CONST",
+    [OP_SUBTRACT_LOCAL_CONST] = "OP_SUBTRACT_LOCAL_CONST",
+    [OP_ADD_NUM] = "OP_ADD_NUM",
+    [OP_ADD_STR] = "OP_ADD_STR",
+    [OP_EQUAL_NUM] = "OP_EQUAL_NUM",
+};
+
+const char *opcodeName(uint8_t opcode) {
+  return opcode < OP_COUNT ? opcodeNames[opcode] : "unknown";
 }
 
 int disassembleInstruction(Chunk *chunk, int offset) {
@@ -86,11 +195,11 @@ int disassembleInstruction(Chunk *chunk, int offset) {
   case OP_CONSTANT:
     return constantInstruction("OP_CONSTANT", chunk, offset);
   case OP_DEFINE_GLOBAL:
-    return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+    return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
   case OP_GET_GLOBAL:
-    return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+    return globalInstruction("OP_GET_GLOBAL", chunk, offset);
   case OP_SET_GLOBAL:
-    return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+    return globalInstruction("OP_SET_GLOBAL", chunk, offset);
   case OP_GET_LOCAL:
     return byteInstruction("OP_GET_LOCAL", chunk, offset);
   case OP_SET_LOCAL:
@@ -103,6 +212,8 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     return jumpInstruction("OP_LOOP", -1, chunk, offset);
   case OP_CALL:
     return byteInstruction("OP_CALL", chunk, offset);
+  case OP_TAIL_CALL:
+    return byteInstruction("OP_TAIL_CALL", chunk, offset);
   case OP_CLOSURE: {
     offset++;
     uint8_t constant = chunk->code[offset++];
@@ -114,8 +225,8 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     for (int j = 0; j < function->upvalueCount; j++) {
       int isLocal = chunk->code[offset++];
       int index = chunk->code[offset++];
-      printf("%04d      |                     %s %d\n", offset - 2,
-             isLocal ? "local" : "upvalue", index);
+      printf("%*s%04d      |                     %s %d\n", annotationWidth, "",
+             offset - 2, isLocal ? "local" : "upvalue", index);
     }
 
     return offset;
@@ -126,6 +237,38 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     return byteInstruction("OP_SET_UPVALUE", chunk, offset);
   case OP_CLOSE_UPVALUE:
     return simpleInstruction("OP_CLOSE_UPVALUE", offset);
+  case OP_NOT_EQUAL:
+    return simpleInstruction("OP_NOT_EQUAL", offset);
+  case OP_LESS_EQUAL:
+    return simpleInstruction("OP_LESS_EQUAL", offset);
+  case OP_GREATER_EQUAL:
+    return simpleInstruction("OP_GREATER_EQUAL", offset);
+  case OP_POP_JUMP_IF_FALSE:
+    return jumpInstruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
+  case OP_JUMP_IF_NOT_EQUAL:
+    return jumpInstruction("OP_JUMP_IF_NOT_EQUAL", 1, chunk, offset);
+  case OP_JUMP_IF_EQUAL:
+    return jumpInstruction("OP_JUMP_IF_EQUAL", 1, chunk, offset);
+  case OP_JUMP_IF_NOT_LESS:
+    return jumpInstruction("OP_JUMP_IF_NOT_LESS", 1, chunk, offset);
+  case OP_JUMP_IF_NOT_LESS_EQUAL:
+    return jumpInstruction("OP_JUMP_IF_NOT_LESS_EQUAL", 1, chunk, offset);
+  case OP_JUMP_IF_NOT_GREATER:
+    return jumpInstruction("OP_JUMP_IF_NOT_GREATER", 1, chunk, offset);
+  case OP_JUMP_IF_NOT_GREATER_EQUAL:
+    return jumpInstruction("OP_JUMP_IF_NOT_GREATER_EQUAL", 1, chunk, offset);
+  case OP_GET_LOCAL_2:
+    return twoByteInstruction("OP_GET_LOCAL_2", chunk, offset);
+  case OP_ADD_LOCAL_CONST:
+    return localConstantInstruction("OP_ADD_LOCAL_CONST", chunk, offset);
+  case OP_SUBTRACT_LOCAL_CONST:
+    return localConstantInstruction("OP_SUBTRACT_LOCAL_CONST", chunk, offset);
+  case OP_ADD_NUM:
+    return simpleInstruction("OP_ADD_NUM", offset);
+  case OP_ADD_STR:
+    return simpleInstruction("OP_ADD_STR", offset);
+  case OP_EQUAL_NUM:
+    return simpleInstruction("OP_EQUAL_NUM", offset);
   default:
     printf("Unknown opcode %d %d \n", instruction, OP_RETURN);
     return offset + 1;
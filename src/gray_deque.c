@@ -0,0 +1,121 @@
+#include "gray_deque.h"
+
+#ifdef PARALLEL_GC
+#include <stdlib.h>
+
+// the deque follows "Correct and Efficient Work-Stealing for Weak Memory
+// Models" (Lê et al.), the gc owns its own memory so arrays are malloc'd and
+// not counted in bytesAllocated
+
+#define DEQUE_MIN_CAPACITY 256
+
+static GrayArray *newGrayArray(int64_t capacity) {
+  GrayArray *array =
+      (GrayArray *)malloc(sizeof(GrayArray) + sizeof(Obj *) * capacity);
+  if (array == NULL)
+    exit(1);
+  array->capacity = capacity;
+  array->retired = NULL;
+  return array;
+}
+
+void initGrayDeque(GrayDeque *deque) {
+  deque->top = 0;
+  deque->bottom = 0;
+  deque->array = newGrayArray(DEQUE_MIN_CAPACITY);
+}
+
+void freeGrayDeque(GrayDeque *deque) {
+  releaseRetiredArrays(deque);
+  free(deque->array);
+  deque->array = NULL;
+}
+
+static Obj *readSlot(GrayArray *array, int64_t idx) {
+  return __atomic_load_n(&array->objects[idx & (array->capacity - 1)],
+                         __ATOMIC_RELAXED);
+}
+
+static void writeSlot(GrayArray *array, int64_t idx, Obj *object) {
+  __atomic_store_n(&array->objects[idx & (array->capacity - 1)], object,
+                   __ATOMIC_RELAXED);
+}
+
+static GrayArray *growDeque(GrayDeque *deque, GrayArray *array, int64_t top,
+                            int64_t bottom) {
+  GrayArray *grown = newGrayArray(array->capacity * 2);
+  for (int64_t i = top; i < bottom; i++) {
+    writeSlot(grown, i, readSlot(array, i));
+  }
+  grown->retired = array;
+  __atomic_store_n(&deque->array, grown, __ATOMIC_RELEASE);
+  return grown;
+}
+
+void pushGrayDeque(GrayDeque *deque, Obj *object) {
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  GrayArray *array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+  if (bottom - top > array->capacity - 1) {
+    array = growDeque(deque, array, top, bottom);
+  }
+  writeSlot(array, bottom, object);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+}
+
+Obj *takeGrayDeque(GrayDeque *deque) {
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+  GrayArray *array = __atomic_load_n(&deque->array, __ATOMIC_RELAXED);
+  __atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+  if (top > bottom) {
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  Obj *object = readSlot(array, bottom);
+  if (top == bottom) {
+    // the last object, a thief may be after it too
+    if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+      object = NULL;
+    }
+    __atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+  }
+  return object;
+}
+
+Obj *stealGrayDeque(GrayDeque *deque) {
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+  if (top >= bottom) {
+    return NULL;
+  }
+  GrayArray *array = __atomic_load_n(&deque->array, __ATOMIC_ACQUIRE);
+  Obj *object = readSlot(array, top);
+  if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, false,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    return NULL;
+  }
+  return object;
+}
+
+bool isGrayDequeEmpty(GrayDeque *deque) {
+  int64_t top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  int64_t bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+  return top >= bottom;
+}
+
+void releaseRetiredArrays(GrayDeque *deque) {
+  GrayArray *array = deque->array->retired;
+  while (array != NULL) {
+    GrayArray *next = array->retired;
+    free(array);
+    array = next;
+  }
+  deque->array->retired = NULL;
+}
+#endif
@@ -0,0 +1,40 @@
+#ifndef clox_gray_deque_h
+#define clox_gray_deque_h
+
+#include "common.h"
+#include "object.h"
+
+#ifdef PARALLEL_GC
+// gray objects of one mark worker, the owner pushes and takes at the bottom,
+// idle workers steal from the top (Chase-Lev)
+typedef struct GrayArray {
+  int64_t capacity;
+  // arrays outgrown during a collection, thieves may still read them
+  struct GrayArray *retired;
+  Obj *objects[];
+} GrayArray;
+
+typedef struct {
+  // top and bottom are written by different threads, keep them apart
+  _Alignas(64) int64_t top;
+  _Alignas(64) int64_t bottom;
+  GrayArray *array;
+} GrayDeque;
+
+void initGrayDeque(GrayDeque *deque);
+void freeGrayDeque(GrayDeque *deque);
+
+// owner only
+void pushGrayDeque(GrayDeque *deque, Obj *object);
+// owner only, NULL when the deque is empty
+Obj *takeGrayDeque(GrayDeque *deque);
+// any thread, NULL when the deque is empty or another thread won the race
+Obj *stealGrayDeque(GrayDeque *deque);
+bool isGrayDequeEmpty(GrayDeque *deque);
+
+// frees the arrays outgrown during the collection, once no thread can still
+// be stealing
+void releaseRetiredArrays(GrayDeque *deque);
+#endif
+
+#endif
@@ -0,0 +1,113 @@
+#include "hash.h"
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+// wyhash, reads the key 8 bytes at a time and folds them with 64x64->128 bit
+// multiplications, see https://github.com/wangyi-fudan/wyhash
+
+static const uint64_t secret[4] = {0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull,
+                                   0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull};
+
+// used until seedHash is called, keeps embedders and benchmarks deterministic
+static uint64_t hashSeed = 0x9e3779b97f4a7c15ull;
+
+// low and high half of a * b
+static void multiply(uint64_t *a, uint64_t *b) {
+#ifdef __SIZEOF_INT128__
+  __uint128_t product = (__uint128_t)*a * *b;
+  *a = (uint64_t)product;
+  *b = (uint64_t)(product >> 64);
+#else
+  uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  uint64_t t = rl + (rm0 << 32);
+  uint64_t carry = t < rl;
+  uint64_t lo = t + (rm1 << 32);
+  carry += lo < t;
+  *a = lo;
+  *b = rh + (rm0 >> 32) + (rm1 >> 32) + carry;
+#endif
+}
+
+static uint64_t mix(uint64_t a, uint64_t b) {
+  multiply(&a, &b);
+  return a ^ b;
+}
+
+// unaligned little endian reads, memcpy compiles down to a single load
+static uint64_t read64(const uint8_t *p) {
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static uint64_t read32(const uint8_t *p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+// 1 to 3 bytes, first, middle and last
+static uint64_t read3(const uint8_t *p, int length) {
+  return ((uint64_t)p[0] << 16) | ((uint64_t)p[length >> 1] << 8) |
+         p[length - 1];
+}
+
+void seedHash(uint64_t seed) {
+  hashSeed = seed ^ mix(seed ^ secret[0], secret[1]);
+}
+
+uint64_t randomHashSeed() {
+  // address space layout randomization and the clock are enough to keep the
+  // seed unpredictable from inside a script
+  uint64_t seed = (uint64_t)time(NULL);
+  seed = mix(seed ^ secret[2], (uint64_t)clock() ^ secret[3]);
+  seed = mix(seed ^ (uint64_t)(uintptr_t)&seed, secret[0]);
+  return mix(seed ^ (uint64_t)(uintptr_t)&hashSeed, secret[1]);
+}
+
+uint32_t hashBytes(const char *key, int length) {
+  const uint8_t *p = (const uint8_t *)key;
+  uint64_t seed = hashSeed;
+  uint64_t a, b;
+  if (length <= 16) {
+    if (length >= 4) {
+      // two overlapping 4 byte reads from each end cover 4 to 16 bytes
+      int middle = (length >> 3) << 2;
+      a = (read32(p) << 32) | read32(p + middle);
+      b = (read32(p + length - 4) << 32) | read32(p + length - 4 - middle);
+    } else if (length > 0) {
+      a = read3(p, length);
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    int left = length;
+    if (left > 48) {
+      // three independent lanes keep the multipliers busy on long strings
+      uint64_t seed1 = seed, seed2 = seed;
+      do {
+        seed = mix(read64(p) ^ secret[1], read64(p + 8) ^ seed);
+        seed1 = mix(read64(p + 16) ^ secret[2], read64(p + 24) ^ seed1);
+        seed2 = mix(read64(p + 32) ^ secret[3], read64(p + 40) ^ seed2);
+        p += 48;
+        left -= 48;
+      } while (left > 48);
+      seed ^= seed1 ^ seed2;
+    }
+    while (left > 16) {
+      seed = mix(read64(p) ^ secret[1], read64(p + 8) ^ seed);
+      p += 16;
+      left -= 16;
+    }
+    a = read64(p + left - 16);
+    b = read64(p + left - 8);
+  }
+  a ^= secret[1];
+  b ^= seed;
+  multiply(&a, &b);
+  uint64_t hash = mix(a ^ secret[0] ^ (uint64_t)length, b ^ secret[1]);
+  return (uint32_t)(hash ^ (hash >> 32));
+}
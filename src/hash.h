@@ -0,0 +1,15 @@
+#ifndef clox_hash_h
+#define clox_hash_h
+
+#include "common.h"
+
+// every string hash depends on this seed, it has to be set before the first
+// string is created and stay the same for the lifetime of the vm
+void seedHash(uint64_t seed);
+
+// a seed that differs between runs, so inputs can't be crafted to collide
+uint64_t randomHashSeed();
+
+uint32_t hashBytes(const char *key, int length);
+
+#endif
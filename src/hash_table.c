@@ -6,6 +6,212 @@
 #include <stdint.h>
 #include <string.h>
 
+#ifdef SWISS_TABLE
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// control bytes of slots without a key have the high bit set, full slots keep
+// the low 7 bits of the key hash
+#define CONTROL_EMPTY ((uint8_t)0x80)
+#define CONTROL_DELETED ((uint8_t)0xfe)
+
+// bit i of the result is set when control byte i of the group equals byte
+static uint32_t matchByte(const uint8_t *group, uint8_t byte) {
+#if defined(__SSE2__)
+  __m128i controls = _mm_loadu_si128((const __m128i *)group);
+  return (uint32_t)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(controls, _mm_set1_epi8((char)byte)));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < TABLE_GROUP_WIDTH; i++) {
+    mask |= (uint32_t)(group[i] == byte) << i;
+  }
+  return mask;
+#endif
+}
+
+// empty and deleted slots, the only control bytes with the high bit set
+static uint32_t matchFree(const uint8_t *group) {
+#if defined(__SSE2__)
+  return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#else
+  uint32_t mask = 0;
+  for (int i = 0; i < TABLE_GROUP_WIDTH; i++) {
+    mask |= (uint32_t)(group[i] >> 7) << i;
+  }
+  return mask;
+#endif
+}
+
+static int lowestBit(uint32_t mask) { return __builtin_ctz(mask); }
+
+static uint8_t hashFragment(uint32_t hash) { return hash & 0x7f; }
+
+// groups are visited at triangular offsets from the home group, which covers
+// every group when their number is a power of two
+static int firstGroup(HashTable *table, uint32_t hash) {
+  return (hash >> 7) & (table->capacity / TABLE_GROUP_WIDTH - 1);
+}
+
+static int nextGroup(HashTable *table, int group, int step) {
+  return (group + step) & (table->capacity / TABLE_GROUP_WIDTH - 1);
+}
+
+static int maxLoad(int capacity) { return capacity - capacity / 8; }
+
+// slot of key or -1, a probe ends at the first group with an empty slot
+static int findSlot(HashTable *table, ObjString *key) {
+  uint8_t fragment = hashFragment(key->hash);
+  int group = firstGroup(table, key->hash);
+  for (int step = 1;; step++) {
+    uint8_t *controls = table->control + group * TABLE_GROUP_WIDTH;
+    uint32_t matches = matchByte(controls, fragment);
+    while (matches != 0) {
+      int slot = group * TABLE_GROUP_WIDTH + lowestBit(matches);
+      if (table->entries[slot].key == key) {
+        return slot;
+      }
+      matches &= matches - 1;
+    }
+    if (matchByte(controls, CONTROL_EMPTY) != 0) {
+      return -1;
+    }
+    group = nextGroup(table, group, step);
+  }
+}
+
+// first empty or deleted slot on the probe sequence of hash
+static int findFreeSlot(HashTable *table, uint32_t hash) {
+  int group = firstGroup(table, hash);
+  for (int step = 1;; step++) {
+    uint32_t free = matchFree(table->control + group * TABLE_GROUP_WIDTH);
+    if (free != 0) {
+      return group * TABLE_GROUP_WIDTH + lowestBit(free);
+    }
+    group = nextGroup(table, group, step);
+  }
+}
+
+// rehashing drops every deleted slot, the table only doubles when live
+// entries would still fill more than half of it
+static void realocateHashTable(HashTable *table, int newCap) {
+  // both arrays are allocated before the table is touched, the gc may walk
+  // it while allocating
+  uint8_t *newControl = ALLOCATE(uint8_t, newCap);
+  Entry *newEntries = ALLOCATE(Entry, newCap);
+  for (int i = 0; i < newCap; i++) {
+    newControl[i] = CONTROL_EMPTY;
+    newEntries[i].key = NULL;
+    newEntries[i].value = NIL_VAL;
+  }
+
+  int oldCap = table->capacity;
+  uint8_t *oldControl = table->control;
+  Entry *oldEntries = table->entries;
+  table->capacity = newCap;
+  table->control = newControl;
+  table->entries = newEntries;
+
+  for (int i = 0; i < oldCap; i++) {
+    ObjString *key = oldEntries[i].key;
+    if (key == NULL) {
+      continue;
+    }
+    int slot = findFreeSlot(table, key->hash);
+    table->control[slot] = hashFragment(key->hash);
+    table->entries[slot] = oldEntries[i];
+  }
+  table->growthLeft = maxLoad(newCap) - table->count;
+
+  FREE_ARRAY(uint8_t, oldControl, oldCap);
+  FREE_ARRAY(Entry, oldEntries, oldCap);
+}
+
+void initHashTable(HashTable *table) {
+  table->capacity = 0;
+  table->count = 0;
+  table->growthLeft = 0;
+  table->control = NULL;
+  table->entries = NULL;
+}
+
+void freeHashTable(HashTable *table) {
+  FREE_ARRAY(uint8_t, table->control, table->capacity);
+  FREE_ARRAY(Entry, table->entries, table->capacity);
+  initHashTable(table);
+}
+
+bool getTableValue(HashTable *table, ObjString *key, Value *value) {
+  if (table->count == 0) {
+    return false;
+  }
+  int slot = findSlot(table, key);
+  if (slot < 0) {
+    return false;
+  }
+  *value = table->entries[slot].value;
+  return true;
+}
+
+bool setTableValue(HashTable *table, ObjString *key, Value value) {
+  if (table->capacity > 0) {
+    int slot = findSlot(table, key);
+    if (slot >= 0) {
+      table->entries[slot].value = value;
+      return false;
+    }
+  }
+
+  int slot = table->capacity > 0 ? findFreeSlot(table, key->hash) : -1;
+  // reusing a deleted slot does not use up the growth budget
+  if (slot < 0 ||
+      (table->control[slot] == CONTROL_EMPTY && table->growthLeft == 0)) {
+    int newCap = table->capacity;
+    if (newCap == 0 || (table->count + 1) * 2 > maxLoad(newCap)) {
+      newCap = newCap == 0 ? TABLE_GROUP_WIDTH : newCap * 2;
+    }
+    realocateHashTable(table, newCap);
+    slot = findFreeSlot(table, key->hash);
+  }
+
+  if (table->control[slot] == CONTROL_EMPTY) {
+    table->growthLeft--;
+  }
+  table->control[slot] = hashFragment(key->hash);
+  table->entries[slot].key = key;
+  table->entries[slot].value = value;
+  table->count++;
+  return true;
+}
+
+bool deleteTableValue(HashTable *table, ObjString *key) {
+  if (table->count == 0) {
+    return false;
+  }
+  int slot = findSlot(table, key);
+  if (slot < 0) {
+    return false;
+  }
+  // probes stop at a group that has an empty slot, so if this group already
+  // has one nothing probes past it and the slot can become empty again,
+  // otherwise it has to stay a tombstone
+  uint8_t *controls =
+      table->control + slot / TABLE_GROUP_WIDTH * TABLE_GROUP_WIDTH;
+  if (matchByte(controls, CONTROL_EMPTY) != 0) {
+    table->control[slot] = CONTROL_EMPTY;
+    table->growthLeft++;
+  } else {
+    table->control[slot] = CONTROL_DELETED;
+  }
+  table->entries[slot].key = NULL;
+  table->entries[slot].value = NIL_VAL;
+  table->count--;
+  return true;
+}
+
+#else
+
 #define TABLE_MAX_LOAD 0.75
 
 static Entry *findEntry(Entry *entries, ObjString *key, int capacity) {
@@ -37,30 +243,6 @@ static Entry *findEntry(Entry *entries, ObjString *key, int capacity) {
   return NULL;
 }
 
-ObjString *findTableString(HashTable *table, const char *string, int length,
-                           uint32_t hash) {
-  if (table->count == 0) {
-    return NULL;
-  }
-  uint32_t bucketIdx = hash & (table->capacity - 1);
-  Entry *tombstone = NULL;
-  for (;;) {
-    Entry *entryToCheck = &table->entries[bucketIdx];
-    if (entryToCheck->key == NULL) {
-      // bucket is not set
-      if (IS_NIL(entryToCheck->value)) {
-        return NULL;
-      }
-
-    } else if (entryToCheck->key->length == length &&
-               entryToCheck->key->hash == hash &&
-               memcmp(entryToCheck->key->chars, string, length) == 0) {
-      return entryToCheck->key;
-    }
-    bucketIdx = (bucketIdx + 1) & (table->capacity - 1);
-  }
-}
-
 static void realocateHashTable(HashTable *table, int newCap) {
   // allocate new buckets
   Entry *newBuckets = ALLOCATE(Entry, newCap);
@@ -133,15 +315,6 @@ bool setTableValue(HashTable *table, ObjString *key, Value value) {
   return isNewEntry;
 }
 
-void tableAddAll(HashTable *from, HashTable *to) {
-  for (int i = 0; i < from->capacity; i++) {
-    Entry *entry = &from->entries[i];
-    if (entry->key != NULL) {
-      setTableValue(to, entry->key, entry->value);
-    }
-  }
-}
-
 bool deleteTableValue(HashTable *table, ObjString *key) {
   if (table->count == 0) {
     return false;
@@ -155,6 +328,17 @@ bool deleteTableValue(HashTable *table, ObjString *key) {
   return true;
 }
 
+#endif
+
+void tableAddAll(HashTable *from, HashTable *to) {
+  for (int i = 0; i < from->capacity; i++) {
+    Entry *entry = &from->entries[i];
+    if (entry->key != NULL) {
+      setTableValue(to, entry->key, entry->value);
+    }
+  }
+}
+
 void markTable(HashTable *table) {
   for (int idx = 0; idx < table->capacity; idx++) {
     Entry *cur = &table->entries[idx];
@@ -163,11 +347,12 @@ void markTable(HashTable *table) {
   }
 }
 
-void tableRemoveWhite(HashTable *table) {
-  for (int i = 0; i < table->capacity; i++) {
-    Entry *entry = &table->entries[i];
-    if (entry->key != NULL && !entry->key->obj.isMarked) {
-      deleteTableValue(table, entry->key);
-    }
+#ifdef COMPACTING_GC
+void forwardTable(HashTable *table) {
+  for (int idx = 0; idx < table->capacity; idx++) {
+    Entry *cur = &table->entries[idx];
+    cur->key = (ObjString *)forwardObj((Obj *)cur->key);
+    cur->value = forwardValue(cur->value);
   }
 }
+#endif
@@ -9,11 +9,28 @@ typedef struct {
   Value value;
 } Entry;
 
+#ifdef SWISS_TABLE
+// slots are probed in groups of this many control bytes
+#define TABLE_GROUP_WIDTH 16
+
 typedef struct {
+  // live entries only, deleted slots are not counted
   int count;
   int capacity;
+  // how many empty slots can still be filled before the table must grow
+  int growthLeft;
+  // one byte per slot, either a 7 bit fragment of the key hash for a full
+  // slot or one of the empty or deleted markers
+  uint8_t *control;
   Entry *entries;
 } HashTable;
+#else
+typedef struct {
+  int count;
+  int capacity;
+  Entry *entries;
+} HashTable;
+#endif
 
 void initHashTable(HashTable *table);
 
@@ -27,12 +44,13 @@ void tableAddAll(HashTable *from, HashTable *to);
 
 bool deleteTableValue(HashTable *table, ObjString *key);
 
-ObjString *findTableString(HashTable *table, const char *string, int length,
-                           uint32_t hash);
-
 void markTable(HashTable* table);
 
-void tableRemoveWhite(HashTable* table);
+#ifdef COMPACTING_GC
+// points keys and values at the objects a compaction moved, keys are hashed
+// by contents so no entry changes its slot
+void forwardTable(HashTable *table);
+#endif
 
 
 
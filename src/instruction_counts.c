@@ -0,0 +1,117 @@
+#include "instruction_counts.h"
+#include "debug.h"
+#include "metrics.h"
+#include "vm.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+static uint64_t opcodeHits[OP_COUNT];
+static uint64_t opcodeCycles[OP_COUNT];
+static uint64_t totalHits = 0;
+
+// the instruction running since lastStamp, it is charged once the next one
+// starts, every instruction ends in a dispatch so none is missed but the last
+static uint64_t *runningCycles = NULL;
+static uint8_t runningOpcode;
+static uint64_t lastStamp;
+
+static uint64_t readCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return (uint64_t)(metricsClock() * 1e9);
+#endif
+}
+
+static uint64_t *allocateCounters(int count) {
+  uint64_t *counters = (uint64_t *)calloc(count, sizeof(uint64_t));
+  if (counters == NULL) {
+    exit(1);
+  }
+  return counters;
+}
+
+void countInstruction(Chunk *chunk, uint8_t *ip) {
+  if (chunk->hits == NULL) {
+    // kept outside the heap so counting does not change when the gc runs
+    chunk->hits = allocateCounters(chunk->count);
+    if (vm.countMode == COUNT_CYCLES) {
+      chunk->cycles = allocateCounters(chunk->count);
+    }
+  }
+  int offset = (int)(ip - chunk->code);
+  chunk->hits[offset]++;
+  opcodeHits[*ip]++;
+  totalHits++;
+
+  if (vm.countMode == COUNT_CYCLES) {
+    uint64_t now = readCycles();
+    if (runningCycles != NULL) {
+      *runningCycles += now - lastStamp;
+      opcodeCycles[runningOpcode] += now - lastStamp;
+    }
+    runningCycles = &chunk->cycles[offset];
+    runningOpcode = *ip;
+    // the time spent counting is left out
+    lastStamp = readCycles();
+  }
+}
+
+uint64_t countedInstructions() { return totalHits; }
+
+static int compareOpcodes(const void *a, const void *b) {
+  uint64_t hitsA = opcodeHits[*(const int *)a];
+  uint64_t hitsB = opcodeHits[*(const int *)b];
+  return hitsA < hitsB ? 1 : hitsA > hitsB ? -1 : 0;
+}
+
+static void printOpcodeCounts() {
+  int opcodes[OP_COUNT];
+  for (int i = 0; i < OP_COUNT; i++) {
+    opcodes[i] = i;
+  }
+  qsort(opcodes, OP_COUNT, sizeof(int), compareOpcodes);
+
+  printf("== opcodes ==\n");
+  for (int i = 0; i < OP_COUNT && opcodeHits[opcodes[i]] > 0; i++) {
+    int opcode = opcodes[i];
+    printf("%-28s %12llu %5.1f%%", opcodeName(opcode),
+           (unsigned long long)opcodeHits[opcode],
+           opcodeHits[opcode] * 100.0 / totalHits);
+    if (vm.countMode == COUNT_CYCLES) {
+      printf(" %14llu %8.1f/op", (unsigned long long)opcodeCycles[opcode],
+             (double)opcodeCycles[opcode] / opcodeHits[opcode]);
+    }
+    printf("\n");
+  }
+}
+
+// nested functions are constants of the chunk they are declared in
+static void printFunctionCounts(ObjFunction *function) {
+  Chunk *chunk = &function->chunk;
+  if (chunk->hits != NULL) {
+    disassembleChunk(chunk, function->name == NULL ? "<script>"
+                                                   : function->name->chars);
+  }
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value constant = chunk->constants.values[i];
+    if (IS_OBJ(constant) && OBJ_TYPE(constant) == OBJ_FUNCTION) {
+      printFunctionCounts(AS_FUNCTION(constant));
+    }
+  }
+}
+
+void printInstructionCounts(ObjFunction *script) {
+  // the instruction still running when the script ended is not charged, its
+  // chunk may be freed before the next script runs
+  runningCycles = NULL;
+  if (totalHits == 0) {
+    return;
+  }
+  printOpcodeCounts();
+  printFunctionCounts(script);
+}
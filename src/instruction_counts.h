@@ -0,0 +1,31 @@
+#ifndef clox_instruction_counts_h
+#define clox_instruction_counts_h
+
+#include "chunk.h"
+#include "common.h"
+#include "object.h"
+
+// set with --count, off unless asked for since every instruction of run()
+// then goes through countInstruction()
+typedef enum {
+  COUNT_OFF,
+  // executions per opcode and per offset of every chunk
+  COUNT_HITS,
+  // the same plus the cycles from the start of each instruction to the start
+  // of the next, read with rdtsc, nanoseconds where there is no rdtsc, every
+  // figure includes the cost of counting, so they are only good for
+  // comparing instructions with each other
+  COUNT_CYCLES,
+} CountMode;
+
+// ip points at the opcode about to be executed
+void countInstruction(Chunk *chunk, uint8_t *ip);
+
+// instructions counted so far
+uint64_t countedInstructions();
+
+// the opcodes by executions, then the chunk of every function compiled into
+// script that ran, annotated by disassembleChunk()
+void printInstructionCounts(ObjFunction *script);
+
+#endif
@@ -5,6 +5,10 @@
 #include "chunk.h"
 #include "common.h"
 #include "debug.h"
+#include "hash.h"
+#include "memory.h"
+#include "metrics.h"
+#include "profiler.h"
 #include "vm.h"
 
 char *read_file_contents(const char *filename);
@@ -51,23 +55,175 @@ static char *readFile(const char *path) {
   return fileBuffer;
 }
 
-static void run(const char *path) {
+// the metrics as JSON to the file at path, "-" is stdout
+static void writeStats(const char *path) {
+  if (strcmp(path, "-") == 0) {
+    writeMetrics(stdout);
+    return;
+  }
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    fprintf(stderr, "Could not open file \"%s\".\n", path);
+    exit(74);
+  }
+  writeMetrics(file);
+  fclose(file);
+}
+
+static void run(const char *path, const char *statsPath,
+                const char *profilePath) {
   char *fileContent = readFile(path);
   InterpritationResult result = interpret(fileContent);
   free(fileContent);
+  // failed runs are written too, they are the ones worth looking at
+  if (profilePath != NULL) {
+    stopProfiler();
+    writeProfile();
+  }
+  if (statsPath != NULL) {
+    writeStats(statsPath);
+  }
   if (result == INTERPRET_COMPILE_ERROR)
     exit(65);
   if (result == INTERPRET_RUNTIME_ERROR)
     exit(70);
 }
 
+static void usage() {
+  fprintf(stderr, "Usage: clox [--max-frames=N] [--hash-seed=N] "
+                  "[--gc-target=PERCENT] [--heap-limit=MB] [--stats=PATH] "
+                  "[--profile=PATH] [--profile-rate=HZ] [--count=hits|cycles]");
+#ifdef INCREMENTAL_GC
+  fprintf(stderr, " [--gc-slice=N]");
+#endif
+#ifdef PARALLEL_GC
+  fprintf(stderr, " [--gc-threads=N]");
+#endif
+  fprintf(stderr, " [path]\n");
+  exit(64);
+}
+
+// value of a --name=value option, NULL if arg is a different option
+static const char *optionValue(const char *arg, const char *name) {
+  size_t length = strlen(name);
+  if (strncmp(arg, name, length) != 0 || arg[length] != '=') {
+    return NULL;
+  }
+  return arg + length + 1;
+}
+
+static int parsePositive(const char *value) {
+  char *end;
+  long number = strtol(value, &end, 10);
+  if (*value == '\0' || *end != '\0' || number <= 0 || number > INT32_MAX) {
+    usage();
+  }
+  return (int)number;
+}
+
+static uint64_t parseSeed(const char *value) {
+  char *end;
+  unsigned long long seed = strtoull(value, &end, 0);
+  if (*value == '\0' || *end != '\0') {
+    usage();
+  }
+  return (uint64_t)seed;
+}
+
 int main(int argc, char *argv[]) {
+  const char *path = NULL;
+  int maxFrames = FRAMES_MAX;
+#ifdef INCREMENTAL_GC
+  int gcSlice = GC_SLICE_BUDGET;
+#endif
+#ifdef PARALLEL_GC
+  int gcThreads = 0;
+#endif
+  // a fixed seed makes table layouts reproducible between runs
+  const char *seed = getenv("CLOX_HASH_SEED");
+  // long running processes set their collector up through the environment,
+  // the command line wins
+  const char *gcTarget = getenv("CLOX_GC_TARGET");
+  const char *heapLimit = getenv("CLOX_HEAP_LIMIT");
+  // the runtime metrics as JSON once the script is done
+  const char *statsPath = getenv("CLOX_STATS");
+  // folded stacks of the script sampled rate times per second of cpu time
+  const char *profilePath = NULL;
+  int profileRate = PROFILE_RATE;
+  // instruction counts printed with the bytecode once the script is done
+  CountMode countMode = COUNT_OFF;
+  for (int i = 1; i < argc; i++) {
+    const char *value;
+    if ((value = optionValue(argv[i], "--max-frames")) != NULL) {
+      maxFrames = parsePositive(value);
+    } else if ((value = optionValue(argv[i], "--hash-seed")) != NULL) {
+      seed = value;
+    } else if ((value = optionValue(argv[i], "--gc-target")) != NULL) {
+      gcTarget = value;
+    } else if ((value = optionValue(argv[i], "--heap-limit")) != NULL) {
+      heapLimit = value;
+    } else if ((value = optionValue(argv[i], "--stats")) != NULL) {
+      statsPath = value;
+    } else if ((value = optionValue(argv[i], "--profile")) != NULL) {
+      profilePath = value;
+    } else if ((value = optionValue(argv[i], "--profile-rate")) != NULL) {
+      profileRate = parsePositive(value);
+    } else if ((value = optionValue(argv[i], "--count")) != NULL) {
+      if (strcmp(value, "hits") == 0) {
+        countMode = COUNT_HITS;
+      } else if (strcmp(value, "cycles") == 0) {
+        countMode = COUNT_CYCLES;
+      } else {
+        usage();
+      }
+#ifdef INCREMENTAL_GC
+    } else if ((value = optionValue(argv[i], "--gc-slice")) != NULL) {
+      gcSlice = parsePositive(value);
+#endif
+#ifdef PARALLEL_GC
+    } else if ((value = optionValue(argv[i], "--gc-threads")) != NULL) {
+      gcThreads = parsePositive(value);
+      if (gcThreads > GC_MAX_THREADS) {
+        usage();
+      }
+#endif
+    } else if (argv[i][0] == '-' || path != NULL) {
+      usage();
+    } else {
+      path = argv[i];
+    }
+  }
+  if (path == NULL) {
+    usage();
+  }
+
+  seedHash(seed != NULL ? parseSeed(seed) : randomHashSeed());
   initVm();
-  if (argc != 2) {
-    fprintf(stderr, "Usage: clox [path]\n");
-    exit(64);
+  vm.maxFrames = maxFrames;
+  vm.countMode = countMode;
+  if (gcTarget != NULL) {
+    int percent = parsePositive(gcTarget);
+    if (percent > 100) {
+      usage();
+    }
+    vm.gcTarget = percent / 100.0;
+  }
+  if (heapLimit != NULL) {
+    vm.heapLimit = (size_t)parsePositive(heapLimit) * 1024 * 1024;
+  }
+#ifdef INCREMENTAL_GC
+  vm.gcSliceBudget = gcSlice;
+#endif
+#ifdef PARALLEL_GC
+  // initVm() picks one thread per core
+  if (gcThreads > 0) {
+    vm.gcThreads = gcThreads;
+  }
+#endif
+  if (profilePath != NULL) {
+    startProfiler(profilePath, profileRate);
   }
-  run(argv[1]);
+  run(path, statsPath, profilePath);
 
   freeVm();
   return 0;
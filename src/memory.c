@@ -1,31 +1,226 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "chunk.h"
 #include "hash_table.h"
 #include "memory.h"
+#include "metrics.h"
 #include "object.h"
+#include "slab.h"
+#include "string_set.h"
 #include "value.h"
 #include "vm.h"
 
+#if defined(CONCURRENT_GC) || defined(PARALLEL_GC)
+#include <pthread.h>
+#endif
+#ifdef PARALLEL_GC
+#include "gray_deque.h"
+#include <sched.h>
+#endif
+
 #ifdef DEBUG_LOG_GC
 #include "compiler.h"
 #include "debug.h"
 #include <stdio.h>
 #endif
 
-#define GC_HEAP_GROW_FACTOR 2
-void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
+// the collector may resize its own tables, that must not start another
+// collection
+static bool isCollecting = false;
+
+static void recordPause(double start) {
+  recordGcPause(&vm.metrics, metricsClock() - start);
+}
+
+#ifdef LAZY_SWEEP
+// sweeping done by allocations, it is not part of any pause
+static double lazySweepTime = 0;
+#endif
+
+// seconds the collector has taken since the vm started
+static double collectorTime() {
+#ifdef LAZY_SWEEP
+  return vm.metrics.gcTotalPause + lazySweepTime;
+#else
+  return vm.metrics.gcTotalPause;
+#endif
+}
+
+// called once per full collection, the heap growth allowed before the next
+// one goes up while the collector takes more than gcTarget of the time since
+// the last collection and down while it takes less, so small heaps stay small
+// and busy ones stop collecting all the time
+static void adaptGrowth() {
+  double now = metricsClock();
+  double collector = collectorTime();
+  double elapsed = now - vm.gcPacedAt;
+  // the first collection has no earlier one to measure from
+  if (vm.gcPacedAt > 0 && elapsed > 0) {
+    double adjust = (collector - vm.gcPacedCost) / elapsed / vm.gcTarget;
+    if (adjust < GC_ADJUST_MIN) {
+      adjust = GC_ADJUST_MIN;
+    } else if (adjust > GC_ADJUST_MAX) {
+      adjust = GC_ADJUST_MAX;
+    }
+    vm.gcGrowth *= adjust;
+    if (vm.gcGrowth < GC_GROWTH_MIN) {
+      vm.gcGrowth = GC_GROWTH_MIN;
+    } else if (vm.gcGrowth > GC_GROWTH_MAX) {
+      vm.gcGrowth = GC_GROWTH_MAX;
+    }
+  }
+  vm.gcPacedAt = now;
+  vm.gcPacedCost = collector;
+}
+
+// the heap may grow by gcGrowth before the next collection, with a heap limit
+// the collections get closer as the heap nears it
+static void paceCollections() {
+  size_t next = (size_t)(vm.bytesAllocated * vm.gcGrowth);
+  if (next < GC_MIN_HEAP) {
+    next = GC_MIN_HEAP;
+  }
+  if (vm.heapLimit > 0 && next > vm.heapLimit) {
+    next = vm.bytesAllocated < vm.heapLimit
+               ? vm.bytesAllocated + (vm.heapLimit - vm.bytesAllocated) / 2
+               : vm.heapLimit;
+  }
+  vm.nextGC = next;
+}
+
+#ifdef INCREMENTAL_GC
+static void collectSlice();
+#endif
+#ifdef CONCURRENT_GC
+static void waitForMarker();
+static void stopMarker();
+#endif
+#ifdef PARALLEL_GC
+// gray objects go to a private stack first, the deque is paid for only when
+// the stack fills up or another worker has nothing to do
+#define LOCAL_GRAY_MAX 256
+
+typedef struct {
+  GrayDeque deque;
+  Obj *local[LOCAL_GRAY_MAX];
+  int localCount;
+  int id;
+  // segments kept and bytes freed while sweeping, the heap gets them back
+  // once every worker is done
+  HeapSegment *swept;
+  size_t freedBytes;
+  pthread_t thread;
+} MarkWorker;
+
+// the worker the current thread marks or sweeps for, NULL outside the
+// parallel phases
+static _Thread_local MarkWorker *currentWorker = NULL;
+static void pushWorkerGray(Obj *object);
+static void sweepInParallel(HeapSegment *segments);
+static void stopMarkWorkers();
+#endif
+#ifdef LAZY_SWEEP
+static void finishLazySweep();
+static void sweepLazily(size_t needed);
+static void completeLazySweep();
+#endif
+#ifdef COMPACTING_GC
+static void requestCompaction();
+static void compactHeap();
+#endif
+
+// a full collection that leaves no garbage counted in bytesAllocated
+static void collectEverything() {
+  runGc();
+#ifdef LAZY_SWEEP
+  completeLazySweep();
+  finishLazySweep();
+#endif
+}
+
+// the heap went over heapLimit, the script is stopped at the next safepoint
+// unless a full collection brings it back under
+static void collectForHeapLimit() {
+  vm.heapExhausted = true;
+#ifdef GENERATIONAL_GC
+  // objects only move at safepoints, run() collects there before it looks at
+  // the heap again, nextGC is never above the limit so that is a full one
+  vm.gcRequested = true;
+#else
+  collectEverything();
+  vm.heapExhausted = vm.bytesAllocated > vm.heapLimit;
+#endif
+}
+
+// the accounting of every allocation, growing the heap may start a collection
+static void countAllocation(size_t oldSize, size_t newSize) {
   vm.bytesAllocated += newSize - oldSize;
   if (newSize > oldSize) {
+    vm.metrics.bytesAllocated += newSize - oldSize;
+  } else {
+    vm.metrics.bytesFreed += oldSize - newSize;
+  }
+  if (newSize > oldSize && !isCollecting && vm.heapLimit > 0 &&
+      vm.bytesAllocated > vm.heapLimit && !vm.heapExhausted) {
+    // runs even with the collector disabled
+    collectForHeapLimit();
+    return;
+  }
+  if (newSize > oldSize && !isCollecting && vm.gcEnabled) {
+#ifdef LAZY_SWEEP
+    if (vm.sweepList != NULL) {
+      sweepLazily(newSize - oldSize);
+    }
+#endif
+#ifdef GENERATIONAL_GC
+    // objects may move, so collections wait for the next safepoint
+#ifdef DEBUG_STRESS_GC
+    vm.gcRequested = true;
+#endif
+    if (vm.bytesAllocated > vm.nextGC) {
+      vm.gcRequested = true;
+    }
+#elif defined(INCREMENTAL_GC)
+    // a running cycle gets a slice of work on every allocation
+#ifdef DEBUG_STRESS_GC
+    collectSlice();
+#else
+    if (vm.gcPhase != GC_IDLE || vm.bytesAllocated > vm.nextGC) {
+      collectSlice();
+    }
+#endif
+#else
 #ifdef DEBUG_STRESS_GC
     runGc();
 #endif
     if (vm.bytesAllocated > vm.nextGC) {
       runGc();
     }
+#endif
   }
+}
+
+void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
+#ifdef PARALLEL_GC
+  // sweep workers only ever free, they must not touch bytesAllocated
+  if (currentWorker != NULL) {
+    currentWorker->freedBytes += oldSize;
+#ifdef SLAB_ALLOCATOR
+    slabFreeShared(pointer, oldSize);
+#else
+    free(pointer);
+#endif
+    return NULL;
+  }
+#endif
+  countAllocation(oldSize, newSize);
+#ifdef SLAB_ALLOCATOR
+  return slabReallocate(pointer, oldSize, newSize);
+#else
   if (newSize == 0) {
     free(pointer);
     return NULL;
@@ -38,77 +233,511 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize) {
   }
 
   return result;
+#endif
 }
 
-static void freeObject(Obj *object) {
-#ifdef DEBUG_LOG_GC
-  printf("%p free type %d ", (void *)object, object->type);
-  printObject(object);
-  printf("\n");
+void *allocateObjectMemory(size_t size) {
+  countAllocation(0, size);
+#ifdef SLAB_ALLOCATOR
+  return slabAllocateObject(size);
+#else
+  void *result = malloc(size);
+  if (result == NULL) {
+    exit(1);
+  }
+  return result;
+#endif
+}
+
+static void freeObjectMemory(Obj *object, size_t size) {
+#ifdef PARALLEL_GC
+  if (currentWorker != NULL) {
+    currentWorker->freedBytes += size;
+#ifdef SLAB_ALLOCATOR
+    slabFreeSharedObject(object, size);
+#else
+    free(object);
 #endif
-  switch (object->type) {
+    return;
+  }
+#endif
+  vm.bytesAllocated -= size;
+  vm.metrics.bytesFreed += size;
+#ifdef SLAB_ALLOCATOR
+  slabFreeObject(object, size);
+#else
+  free(object);
+#endif
+}
+
+static size_t objectSize(Obj *object) {
+  switch (objType(object)) {
   case OBJ_STRING: {
-    ObjString *stringObj = (ObjString *)object;
-    FREE_ARRAY(char, stringObj->chars, stringObj->length + 1);
-    FREE(ObjString, stringObj);
-    break;
+    // only flat strings carry their characters
+    ObjString *string = (ObjString *)object;
+    if (string->flat == string) {
+      return sizeof(ObjString) + string->length + 1;
+    }
+    return sizeof(ObjString);
+  }
+  case OBJ_FUNCTION:
+    return sizeof(ObjFunction);
+  case OBJ_CLOSURE:
+    return sizeof(ObjClosure) +
+           sizeof(ObjUpvalue *) * ((ObjClosure *)object)->upvalueCount;
+  case OBJ_UPVALUE:
+    return sizeof(ObjUpvalue);
+  case OBJ_NATIVE:
+    return sizeof(ObjNative);
   }
+  return 0;
+}
+
+// memory owned by the object outside of its own allocation
+static void freeObjectData(Obj *object) {
+  switch (objType(object)) {
   case OBJ_FUNCTION: {
     ObjFunction *function = (ObjFunction *)object;
     freeChunk(&function->chunk);
-    FREE(ObjFunction, object);
     break;
   }
+  case OBJ_CLOSURE:
+  case OBJ_STRING:
+  case OBJ_UPVALUE:
+  case OBJ_NATIVE:
+    break;
+  }
+}
+
+static void pushGray(Obj *object) {
+#ifdef PARALLEL_GC
+  if (currentWorker != NULL) {
+    pushWorkerGray(object);
+    return;
+  }
+#endif
+  if (vm.grayCap < vm.grayCount + 1) {
+    vm.grayCap = GROW_CAPACITY(vm.grayCap);
+    vm.grayStack = (Obj **)realloc(vm.grayStack, sizeof(Obj *) * vm.grayCap);
+    if (vm.grayStack == NULL)
+      exit(1);
+  }
+  vm.grayStack[vm.grayCount++] = object;
+}
+
+static void freeObject(Obj *object) {
+#ifdef DEBUG_LOG_GC
+  printf("%p free type %d ", (void *)object, objType(object));
+  printObject(object);
+  printf("\n");
+#endif
+  freeObjectData(object);
+  freeObjectMemory(object, objectSize(object));
+}
+
+#if defined(GENERATIONAL_GC) || defined(COMPACTING_GC)
+// the bookkeeping arrays of moving collections belong to the collector, like the gray stack
+// they are not counted in bytesAllocated
+#define GROW_GC_ARRAY(type, array, count, capacity)                            \
+  do {                                                                         \
+    if ((capacity) < (count) + 1) {                                            \
+      (capacity) = GROW_CAPACITY(capacity);                                    \
+      (array) = (type *)realloc((array), sizeof(type) * (capacity));           \
+      if ((array) == NULL) {                                                   \
+        exit(1);                                                               \
+      }                                                                        \
+    }                                                                          \
+  } while (false)
+
+// fields pointing into a moved object itself follow it to the copy
+static void followInteriorPointers(Obj *object, Obj *copy) {
+  if (objType(object) == OBJ_STRING &&
+      ((ObjString *)object)->flat == (ObjString *)object) {
+    ((ObjString *)copy)->flat = (ObjString *)copy;
+  }
+  if (objType(object) == OBJ_UPVALUE &&
+      ((ObjUpvalue *)object)->location == &((ObjUpvalue *)object)->closed) {
+    ((ObjUpvalue *)copy)->location = &((ObjUpvalue *)copy)->closed;
+  }
+}
+#endif
+
+#ifdef GENERATIONAL_GC
+// objects in the nursery sit back to back, each rounded up to this
+static size_t alignSize(size_t size) { return (size + 15) & ~(size_t)15; }
+
+Obj *allocateYoung(size_t size) {
+  if (!vm.allocateYoung || size > NURSERY_MAX_OBJECT) {
+    return NULL;
+  }
+  size = alignSize(size);
+  NurseryBlock *block = vm.nursery;
+  if (block == NULL || block->used + size > NURSERY_BLOCK_SIZE) {
+    // objects can only move at a safepoint, until run() reaches one the
+    // nursery keeps growing by whole blocks
+    if (block != NULL) {
+      vm.gcRequested = true;
+    }
+    block = (NurseryBlock *)malloc(sizeof(NurseryBlock) + NURSERY_BLOCK_SIZE);
+    if (block == NULL) {
+      exit(1);
+    }
+    block->next = vm.nursery;
+    block->used = 0;
+    vm.nursery = block;
+  }
+#ifdef DEBUG_STRESS_GC
+  vm.gcRequested = true;
+#endif
+  Obj *object = (Obj *)(block->data + block->used);
+  block->used += size;
+  vm.metrics.bytesAllocated += size;
+  return object;
+}
+
+void rememberObject(Obj *object) {
+  setObjFlag(object, OBJ_REMEMBERED);
+  GROW_GC_ARRAY(Obj *, vm.rememberedObjects, vm.rememberedCount,
+                vm.rememberedCap);
+  vm.rememberedObjects[vm.rememberedCount++] = object;
+}
+
+void rememberGlobal(int slot) {
+  GROW_GC_ARRAY(int, vm.rememberedGlobals, vm.rememberedGlobalCount,
+                vm.rememberedGlobalCap);
+  vm.rememberedGlobals[vm.rememberedGlobalCount++] = slot;
+}
+
+void rememberYoungString(ObjString *string) {
+  GROW_GC_ARRAY(ObjString *, vm.youngStrings, vm.youngStringCount,
+                vm.youngStringCap);
+  vm.youngStrings[vm.youngStringCount++] = string;
+}
+
+// copies a young object into the old generation the first time it is seen,
+// the copy goes on the gray stack to have its own references evacuated
+static Obj *promote(Obj *object) {
+  if (hasObjFlag(object, OBJ_FORWARDED)) {
+    return objNext(object);
+  }
+  size_t size = objectSize(object);
+  Obj *copy = (Obj *)allocateObjectMemory(size);
+  memcpy(copy, object, size);
+  copy->header = object->header & OBJ_TYPE_MASK;
+  addToHeap(copy);
+  followInteriorPointers(object, copy);
+
+  setObjFlag(object, OBJ_FORWARDED);
+  setObjNext(object, copy);
+  pushGray(copy);
+  return copy;
+}
+
+static Obj *evacuate(Obj *object) {
+  if (object == NULL || !hasObjFlag(object, OBJ_YOUNG)) {
+    return object;
+  }
+  return promote(object);
+}
+
+static Value evacuateValue(Value value) {
+  if (IS_OBJ(value) && hasObjFlag(AS_OBJ(value), OBJ_YOUNG)) {
+    return OBJ_VAL(promote(AS_OBJ(value)));
+  }
+  return value;
+}
+
+static void evacuateFields(Obj *object) {
+  switch (objType(object)) {
   case OBJ_CLOSURE: {
     ObjClosure *closure = (ObjClosure *)object;
-    FREE_ARRAY(ObjUpvalue *, closure->upvalues, closure->upvalueCount);
-    FREE(ObjClosure, object);
+    closure->function = (ObjFunction *)evacuate((Obj *)closure->function);
+    for (int i = 0; i < closure->upvalueCount; i++) {
+      closure->upvalues[i] = (ObjUpvalue *)evacuate((Obj *)closure->upvalues[i]);
+    }
     break;
   }
-  case OBJ_UPVALUE: {
-    FREE(ObjUpvalue, object);
+  case OBJ_FUNCTION: {
+    ObjFunction *function = (ObjFunction *)object;
+    function->name = (ObjString *)evacuate((Obj *)function->name);
+    ValueArray *constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++) {
+      constants->values[i] = evacuateValue(constants->values[i]);
+    }
     break;
   }
-  case OBJ_NATIVE: {
-    FREE(ObjNative, object);
+  case OBJ_UPVALUE:
+    // next is only meaningful while the upvalue is open, the open list is a
+    // root of its own
+    ((ObjUpvalue *)object)->closed =
+        evacuateValue(((ObjUpvalue *)object)->closed);
+    break;
+  case OBJ_STRING: {
+    ObjString *string = (ObjString *)object;
+    string->left = (ObjString *)evacuate((Obj *)string->left);
+    string->right = (ObjString *)evacuate((Obj *)string->right);
+    string->flat = (ObjString *)evacuate((Obj *)string->flat);
     break;
   }
+  case OBJ_NATIVE:
+    break;
   }
 }
 
-void freeObjectPool() {
-  Obj *cur = vm.objectHeap;
-  while (cur != NULL) {
-    Obj *next = cur->next;
-    freeObject(cur);
-    cur = next;
+// every young object is either copied or dead by now, the dead ones give
+// back the memory they own outside the nursery, then the newest block is
+// reused and the rest are released
+static void releaseNursery() {
+  NurseryBlock *block = vm.nursery;
+  vm.nursery = NULL;
+  while (block != NULL) {
+    for (size_t offset = 0; offset < block->used;) {
+      Obj *object = (Obj *)(block->data + offset);
+      offset += alignSize(objectSize(object));
+      if (!hasObjFlag(object, OBJ_FORWARDED)) {
+        freeObjectData(object);
+      }
+    }
+    vm.metrics.bytesFreed += block->used;
+    NurseryBlock *next = block->next;
+    if (vm.nursery == NULL) {
+      block->used = 0;
+      block->next = NULL;
+      vm.nursery = block;
+    } else {
+      free(block);
+    }
+    block = next;
   }
-  free(vm.grayStack);
-  vm.objectHeap = NULL;
 }
 
-static void sweep() {
-  Obj *prev = NULL;
-  Obj *cur = vm.objectHeap;
-
-  while (cur != NULL) {
-    if (cur->isMarked) {
-      cur->isMarked = false;
-      prev = cur;
-      cur = cur->next;
+// costs in proportion to the surviving young objects and the remembered set,
+// old objects are only touched when a barrier recorded them
+static void minorGc() {
+  size_t before = vm.bytesAllocated;
+  isCollecting = true;
+
+  for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
+    *slot = evacuateValue(*slot);
+  }
+  for (int i = 0; i < vm.frameCount; i++) {
+    vm.frames[i].closure = (ObjClosure *)evacuate((Obj *)vm.frames[i].closure);
+  }
+  vm.openUpvalues = (ObjUpvalue *)evacuate((Obj *)vm.openUpvalues);
+  for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL;
+       upvalue = upvalue->next) {
+    upvalue->next = (ObjUpvalue *)evacuate((Obj *)upvalue->next);
+  }
+  for (int i = 0; i < vm.rememberedGlobalCount; i++) {
+    Value *global = &vm.globalValues.values[vm.rememberedGlobals[i]];
+    *global = evacuateValue(*global);
+  }
+  vm.rememberedGlobalCount = 0;
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    clearObjFlag(vm.rememberedObjects[i], OBJ_REMEMBERED);
+    evacuateFields(vm.rememberedObjects[i]);
+  }
+  vm.rememberedCount = 0;
+  while (vm.grayCount > 0) {
+    evacuateFields(vm.grayStack[--vm.grayCount]);
+  }
+
+  // the pool does not keep strings alive, it follows the ones that moved
+  for (int i = 0; i < vm.youngStringCount; i++) {
+    ObjString *string = vm.youngStrings[i];
+    if (hasObjFlag(&string->obj, OBJ_FORWARDED)) {
+      replaceInternedString(&vm.stringsPool, string,
+                            (ObjString *)objNext(&string->obj));
     } else {
-      Obj *unreacheble = cur;
-      cur = cur->next;
-      if (prev == NULL) {
-        vm.objectHeap = cur;
+      removeInternedString(&vm.stringsPool, string);
+    }
+  }
+  vm.youngStringCount = 0;
+
+  releaseNursery();
+  isCollecting = false;
+  vm.metrics.gcMinorCollections++;
+  vm.metrics.gcPromotedBytes += vm.bytesAllocated - before;
+}
+
+static void freeNursery() {
+  // nothing is forwarded, every young object is treated as dead
+  releaseNursery();
+  free(vm.nursery);
+  vm.nursery = NULL;
+  free(vm.rememberedObjects);
+  free(vm.rememberedGlobals);
+  free(vm.youngStrings);
+}
+#endif
+
+void addToHeap(Obj *object) {
+  HeapSegment *segment = vm.objectHeap;
+  if (segment == NULL || segment->count == HEAP_SEGMENT_OBJECTS) {
+    // segments belong to the collector, like the gray stack they are not
+    // counted in bytesAllocated
+    segment = (HeapSegment *)malloc(sizeof(HeapSegment));
+    if (segment == NULL)
+      exit(1);
+    segment->objects = NULL;
+    segment->count = 0;
+    segment->next = vm.objectHeap;
+    vm.objectHeap = segment;
+  }
+  setObjNext(object, segment->objects);
+  segment->objects = object;
+  segment->count++;
+}
+
+static void freeSegments(HeapSegment *segment) {
+  while (segment != NULL) {
+    HeapSegment *next = segment->next;
+    Obj *cur = segment->objects;
+    while (cur != NULL) {
+      Obj *nextObject = objNext(cur);
+      // a cell must be free with its mark bit clear
+      clearObjMark(cur);
+      freeObject(cur);
+      cur = nextObject;
+    }
+    free(segment);
+    segment = next;
+  }
+}
+
+// frees the unmarked objects of the segment and clears the mark of the rest,
+// a dead object is freed without following its references, so segments can
+// be swept in any order and on any thread
+static void sweepSegment(HeapSegment *segment) {
+  Obj *previous = NULL;
+  Obj *object = segment->objects;
+  while (object != NULL) {
+    Obj *next = objNext(object);
+    if (isObjMarked(object)) {
+      clearObjMark(object);
+      previous = object;
+    } else {
+      if (previous == NULL) {
+        segment->objects = next;
       } else {
-        prev->next = cur;
+        setObjNext(previous, next);
       }
-      freeObject(unreacheble);
+      segment->count--;
+      freeObject(object);
     }
+    object = next;
+  }
+}
+
+// a swept segment goes back to the heap, where it may take new objects, or is
+// released once empty
+static void keepSegment(HeapSegment *segment) {
+  if (segment->count == 0) {
+    free(segment);
+    return;
+  }
+  segment->next = vm.objectHeap;
+  vm.objectHeap = segment;
+}
+
+static void sweepSegments(HeapSegment *segments) {
+#ifdef PARALLEL_GC
+  if (vm.gcThreads > 1 && segments != NULL && segments->next != NULL) {
+    sweepInParallel(segments);
+    return;
+  }
+#endif
+  while (segments != NULL) {
+    HeapSegment *next = segments->next;
+    sweepSegment(segments);
+    keepSegment(segments);
+    segments = next;
   }
 }
 
+void freeObjectPool() {
+#ifdef CONCURRENT_GC
+  // the marker may still be reading the heap
+  waitForMarker();
+#endif
+  freeSegments(vm.objectHeap);
+#if defined(INCREMENTAL_GC) || defined(LAZY_SWEEP)
+  freeSegments(vm.sweepList);
+  vm.sweepList = NULL;
+#endif
+#ifdef CONCURRENT_GC
+  stopMarker();
+#endif
+#ifdef PARALLEL_GC
+  stopMarkWorkers();
+#endif
+  free(vm.grayStack);
+  vm.objectHeap = NULL;
+#ifdef GENERATIONAL_GC
+  freeNursery();
+#endif
+}
+
+#if !defined(INCREMENTAL_GC) && !defined(LAZY_SWEEP)
+static void sweep() {
+  HeapSegment *segments = vm.objectHeap;
+  vm.objectHeap = NULL;
+  sweepSegments(segments);
+}
+#endif
+
+#ifdef LAZY_SWEEP
+// an allocation sweeps at most this many segments, so one that only finds
+// live objects in front of it stays cheap
+#define LAZY_SWEEP_SEGMENTS 4
+
+// the heap has its real size only once every segment is swept, the next
+// collection is paced from there
+static void finishLazySweep() {
+  paceCollections();
+#ifdef SLAB_ALLOCATOR
+  trimSlabs();
+#endif
+#ifdef COMPACTING_GC
+  requestCompaction();
+#endif
+}
+
+// segments left by the last marking are swept until the memory freed covers
+// the allocation
+static void sweepLazily(size_t needed) {
+  double start = metricsClock();
+  size_t before = vm.bytesAllocated;
+  for (int i = 0; i < LAZY_SWEEP_SEGMENTS && vm.sweepList != NULL &&
+                  before - vm.bytesAllocated < needed;
+       i++) {
+    HeapSegment *segment = vm.sweepList;
+    vm.sweepList = segment->next;
+    sweepSegment(segment);
+    keepSegment(segment);
+  }
+  double time = metricsClock() - start;
+  vm.metrics.gcSweepTime += time;
+  lazySweepTime += time;
+  if (vm.sweepList == NULL) {
+    finishLazySweep();
+  }
+}
+
+// marking needs every mark bit cleared, what the allocations did not get to
+// is swept before the next collection
+static void completeLazySweep() {
+  if (vm.sweepList == NULL) {
+    return;
+  }
+  double start = metricsClock();
+  HeapSegment *segments = vm.sweepList;
+  vm.sweepList = NULL;
+  sweepSegments(segments);
+  vm.metrics.gcSweepTime += metricsClock() - start;
+}
+#endif
+
 static void markArray(ValueArray *array) {
   for (int i = 0; i < array->count; i++) {
     markValue(array->values[i]);
@@ -117,11 +746,11 @@ static void markArray(ValueArray *array) {
 
 static void blackenObject(Obj *object) {
 #ifdef DEBUG_LOG_GC
-  printf("%p blacken %d\n", (void *)object, object->type);
-  printValue(OBJ_VAL(object));
+  printf("%p blacken %d\n", (void *)object, objType(object));
+  printObject(object);
   printf("\n");
 #endif
-  switch (object->type) {
+  switch (objType(object)) {
   case OBJ_CLOSURE: {
     ObjClosure *closure = (ObjClosure *)object;
     markObject((Obj *)closure->function);
@@ -139,13 +768,296 @@ static void blackenObject(Obj *object) {
   case OBJ_UPVALUE:
     markValue(((ObjUpvalue *)object)->closed);
     break;
+  case OBJ_STRING: {
+    ObjString *string = (ObjString *)object;
+    markObject((Obj *)string->left);
+    markObject((Obj *)string->right);
+    markObject((Obj *)string->flat);
+    break;
+  }
   case OBJ_NATIVE:
-  case OBJ_STRING:
     break;
   }
 }
 
+#ifdef PARALLEL_GC
+static MarkWorker *workers = NULL;
+static int workerCount = 0;
+// workers that may still push gray objects, marking is over at zero
+static int activeWorkers;
+// the sweep queue holds every segment of the heap, the collector fills it
+// before the workers start
+static HeapSegment **sweepQueue = NULL;
+static int sweepQueueCap = 0;
+static int sweepQueueCount = 0;
+static int sweepQueueNext;
+// the threads sleep between collections and wake up when epoch changes
+static pthread_mutex_t workerLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workerWake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t workerDone = PTHREAD_COND_INITIALIZER;
+static int workerEpoch = 0;
+static int workersRunning = 0;
+static bool workersExit = false;
+// what the workers run once woken up, marking or sweeping
+static void (*workerJob)(MarkWorker *self);
+
+#define IDLE_SPINS 64
+static const struct timespec idleSleep = {0, 20000};
+
+// the oldest half of the private stack is moved where thieves can see it
+static void shareGray(MarkWorker *self) {
+  int half = self->localCount / 2;
+  for (int i = 0; i < half; i++) {
+    pushGrayDeque(&self->deque, self->local[i]);
+  }
+  memmove(self->local, self->local + half,
+          sizeof(Obj *) * (self->localCount - half));
+  self->localCount -= half;
+}
+
+static void pushWorkerGray(Obj *object) {
+  MarkWorker *self = currentWorker;
+  if (self->localCount == LOCAL_GRAY_MAX ||
+      (self->localCount > 1 &&
+       __atomic_load_n(&activeWorkers, __ATOMIC_RELAXED) < workerCount &&
+       isGrayDequeEmpty(&self->deque))) {
+    shareGray(self);
+  }
+  self->local[self->localCount++] = object;
+}
+
+static Obj *nextGray(MarkWorker *self) {
+  if (self->localCount > 0) {
+    return self->local[--self->localCount];
+  }
+  return takeGrayDeque(&self->deque);
+}
+
+static Obj *stealGray(MarkWorker *self) {
+  for (int i = 1; i < workerCount; i++) {
+    MarkWorker *victim = &workers[(self->id + i) % workerCount];
+    Obj *object = stealGrayDeque(&victim->deque);
+    if (object != NULL) {
+      return object;
+    }
+  }
+  return NULL;
+}
+
+static bool anyGrayLeft() {
+  for (int i = 0; i < workerCount; i++) {
+    if (!isGrayDequeEmpty(&workers[i].deque)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// a worker only goes idle with an empty deque and only its owner pushes to
+// it, so once every worker is idle there is nothing left to trace
+static void markAsWorker(MarkWorker *self) {
+  currentWorker = self;
+  for (;;) {
+    Obj *object;
+    while ((object = nextGray(self)) != NULL) {
+      blackenObject(object);
+    }
+    if ((object = stealGray(self)) != NULL) {
+      blackenObject(object);
+      continue;
+    }
+
+    __atomic_fetch_sub(&activeWorkers, 1, __ATOMIC_SEQ_CST);
+    // idle workers back off to sleeping, spinning would take the cores the
+    // busy ones need
+    for (int spins = 0; __atomic_load_n(&activeWorkers, __ATOMIC_SEQ_CST) > 0 &&
+                        !anyGrayLeft();
+         spins++) {
+      if (spins < IDLE_SPINS) {
+        sched_yield();
+      } else {
+        nanosleep(&idleSleep, NULL);
+      }
+    }
+    if (__atomic_load_n(&activeWorkers, __ATOMIC_SEQ_CST) == 0) {
+      break;
+    }
+    __atomic_fetch_add(&activeWorkers, 1, __ATOMIC_SEQ_CST);
+  }
+  currentWorker = NULL;
+}
+
+static void *runMarkWorker(void *arg) {
+  MarkWorker *self = (MarkWorker *)arg;
+  int epoch = 0;
+  pthread_mutex_lock(&workerLock);
+  for (;;) {
+    while (workerEpoch == epoch && !workersExit) {
+      pthread_cond_wait(&workerWake, &workerLock);
+    }
+    if (workersExit) {
+      break;
+    }
+    epoch = workerEpoch;
+    pthread_mutex_unlock(&workerLock);
+    workerJob(self);
+    pthread_mutex_lock(&workerLock);
+    if (--workersRunning == 0) {
+      pthread_cond_signal(&workerDone);
+    }
+  }
+  pthread_mutex_unlock(&workerLock);
+  return NULL;
+}
+
+// worker 0 is the thread running the collection
+static void startMarkWorkers() {
+  workerCount = vm.gcThreads;
+  workers = (MarkWorker *)aligned_alloc(_Alignof(MarkWorker),
+                                        sizeof(MarkWorker) * workerCount);
+  if (workers == NULL)
+    exit(1);
+  for (int i = 0; i < workerCount; i++) {
+    initGrayDeque(&workers[i].deque);
+    workers[i].localCount = 0;
+    workers[i].id = i;
+    workers[i].swept = NULL;
+    workers[i].freedBytes = 0;
+  }
+  for (int i = 1; i < workerCount; i++) {
+    if (pthread_create(&workers[i].thread, NULL, runMarkWorker, &workers[i]) !=
+        0) {
+      fprintf(stderr, "Could not start a mark worker thread.\n");
+      exit(1);
+    }
+  }
+}
+
+static void stopMarkWorkers() {
+  if (workers == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&workerLock);
+  workersExit = true;
+  pthread_cond_broadcast(&workerWake);
+  pthread_mutex_unlock(&workerLock);
+  for (int i = 1; i < workerCount; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  for (int i = 0; i < workerCount; i++) {
+    freeGrayDeque(&workers[i].deque);
+  }
+  free(workers);
+  workers = NULL;
+  workerCount = 0;
+  workersExit = false;
+  free(sweepQueue);
+  sweepQueue = NULL;
+  sweepQueueCap = 0;
+}
+
+// the calling thread runs the job as worker 0 and returns once every worker
+// is done
+static void runOnWorkers(void (*job)(MarkWorker *self)) {
+  if (workers == NULL) {
+    startMarkWorkers();
+  }
+  pthread_mutex_lock(&workerLock);
+  workerJob = job;
+  workerEpoch++;
+  workersRunning = workerCount - 1;
+  pthread_cond_broadcast(&workerWake);
+  pthread_mutex_unlock(&workerLock);
+
+  job(&workers[0]);
+
+  pthread_mutex_lock(&workerLock);
+  while (workersRunning > 0) {
+    pthread_cond_wait(&workerDone, &workerLock);
+  }
+  pthread_mutex_unlock(&workerLock);
+}
+
+static void markInParallel() {
+  if (workers == NULL) {
+    startMarkWorkers();
+  }
+  // the roots are dealt out before any worker runs
+  for (int i = 0; i < vm.grayCount; i++) {
+    pushGrayDeque(&workers[i % workerCount].deque, vm.grayStack[i]);
+  }
+  vm.grayCount = 0;
+  activeWorkers = workerCount;
+
+  runOnWorkers(markAsWorker);
+
+  for (int i = 0; i < workerCount; i++) {
+    releaseRetiredArrays(&workers[i].deque);
+  }
+}
+
+// segments are handed out by index, each worker takes the next one until
+// none are left
+static void sweepAsWorker(MarkWorker *self) {
+  currentWorker = self;
+  for (;;) {
+    int i = __atomic_fetch_add(&sweepQueueNext, 1, __ATOMIC_RELAXED);
+    if (i >= sweepQueueCount) {
+      break;
+    }
+    HeapSegment *segment = sweepQueue[i];
+    sweepSegment(segment);
+    if (segment->count == 0) {
+      free(segment);
+    } else {
+      segment->next = self->swept;
+      self->swept = segment;
+    }
+  }
+  currentWorker = NULL;
+}
+
+static void sweepInParallel(HeapSegment *segments) {
+  sweepQueueCount = 0;
+  for (; segments != NULL; segments = segments->next) {
+    if (sweepQueueCap < sweepQueueCount + 1) {
+      sweepQueueCap = GROW_CAPACITY(sweepQueueCap);
+      sweepQueue = (HeapSegment **)realloc(
+          sweepQueue, sizeof(HeapSegment *) * sweepQueueCap);
+      if (sweepQueue == NULL)
+        exit(1);
+    }
+    sweepQueue[sweepQueueCount++] = segments;
+  }
+  sweepQueueNext = 0;
+
+  runOnWorkers(sweepAsWorker);
+#ifdef SLAB_ALLOCATOR
+  finishSharedFrees();
+#endif
+
+  for (int i = 0; i < workerCount; i++) {
+    MarkWorker *worker = &workers[i];
+    while (worker->swept != NULL) {
+      HeapSegment *segment = worker->swept;
+      worker->swept = segment->next;
+      segment->next = vm.objectHeap;
+      vm.objectHeap = segment;
+    }
+    vm.bytesAllocated -= worker->freedBytes;
+    vm.metrics.bytesFreed += worker->freedBytes;
+    worker->freedBytes = 0;
+  }
+}
+#endif
+
 static void traceReferences() {
+#ifdef PARALLEL_GC
+  if (vm.gcThreads > 1) {
+    markInParallel();
+    return;
+  }
+#endif
   while (vm.grayCount > 0) {
     Obj *object = vm.grayStack[--vm.grayCount];
     blackenObject(object);
@@ -156,23 +1068,17 @@ void markObject(Obj *object) {
   if (object == NULL) {
     return;
   }
-  if (object->isMarked) {
+  // mark workers race for the object, only the one that sets the bit traces
+  // it
+  if (!tryMarkObj(object)) {
     return;
   }
 #ifdef DEBUG_LOG_GC
   printf("%p mark ", (void *)object);
-  printValue(OBJ_VAL(object));
+  printObject(object);
   printf("\n");
 #endif
-  object->isMarked = true;
-
-  if (vm.grayCap < vm.grayCount + 1) {
-    vm.grayCap = GROW_CAPACITY(vm.grayCap);
-    vm.grayStack = (Obj **)realloc(vm.grayStack, sizeof(Obj *) * vm.grayCap);
-    if (vm.grayStack == NULL)
-      exit(1);
-  }
-  vm.grayStack[vm.grayCount++] = object;
+  pushGray(object);
 }
 
 void markValue(Value value) {
@@ -195,25 +1101,505 @@ void static markRoots() {
     markObject((Obj *)curUpvalue);
   }
 
-  markTable(&vm.globals);
+  markTable(&vm.globalSlots);
+  markArray(&vm.globalNames);
+  markArray(&vm.globalValues);
   markCompilerRoots();
 }
 
-void runGc() {
-#ifdef DEBUG_LOG_STATS_GC
-  printf("-- gc begin\n");
-  size_t before = vm.bytesAllocated;
+#ifdef INCREMENTAL_GC
+#ifdef CONCURRENT_GC
+// the marker thread owns the gray stack from the end of markRoots() until it
+// runs out of work, the mutator hands it overwritten references through a
+// separate buffer, both are guarded by markLock
+static pthread_mutex_t markLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t markWake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t markDone = PTHREAD_COND_INITIALIZER;
+static pthread_t marker;
+static bool markerStarted = false;
+static bool markerBusy = false;
+static bool markerExit = false;
+static Obj **overwritten = NULL;
+static int overwrittenCount = 0;
+static int overwrittenCap = 0;
+
+void rememberOverwritten(Obj *object) {
+  pthread_mutex_lock(&markLock);
+  if (overwrittenCap < overwrittenCount + 1) {
+    overwrittenCap = GROW_CAPACITY(overwrittenCap);
+    overwritten = (Obj **)realloc(overwritten, sizeof(Obj *) * overwrittenCap);
+    if (overwritten == NULL)
+      exit(1);
+  }
+  overwritten[overwrittenCount++] = object;
+  pthread_mutex_unlock(&markLock);
+}
+
+static void markOverwritten() {
+  for (int i = 0; i < overwrittenCount; i++) {
+    markObject(overwritten[i]);
+  }
+  overwrittenCount = 0;
+}
+
+// pointer sized fields are read while the mutator may be storing to them, the
+// marker sees either value and the barrier keeps the old one alive
+static void *runMarker(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&markLock);
+  while (!markerExit) {
+    if (!markerBusy) {
+      pthread_cond_wait(&markWake, &markLock);
+      continue;
+    }
+    markOverwritten();
+    if (vm.grayCount == 0) {
+      markerBusy = false;
+      pthread_cond_signal(&markDone);
+      continue;
+    }
+    pthread_mutex_unlock(&markLock);
+    traceReferences();
+    pthread_mutex_lock(&markLock);
+  }
+  pthread_mutex_unlock(&markLock);
+  return NULL;
+}
+
+static void wakeMarker() {
+  if (!markerStarted) {
+    if (pthread_create(&marker, NULL, runMarker, NULL) != 0) {
+      fprintf(stderr, "Could not start the marker thread.\n");
+      exit(1);
+    }
+    markerStarted = true;
+  }
+  pthread_mutex_lock(&markLock);
+  markerBusy = true;
+  pthread_cond_signal(&markWake);
+  pthread_mutex_unlock(&markLock);
+}
+
+static bool isMarkerBusy() {
+  pthread_mutex_lock(&markLock);
+  bool busy = markerBusy;
+  pthread_mutex_unlock(&markLock);
+  return busy;
+}
+
+static void waitForMarker() {
+  pthread_mutex_lock(&markLock);
+  while (markerBusy) {
+    pthread_cond_wait(&markDone, &markLock);
+  }
+  pthread_mutex_unlock(&markLock);
+}
+
+static void stopMarker() {
+  if (markerStarted) {
+    pthread_mutex_lock(&markLock);
+    markerExit = true;
+    pthread_cond_signal(&markWake);
+    pthread_mutex_unlock(&markLock);
+    pthread_join(marker, NULL);
+    markerStarted = false;
+    markerExit = false;
+  }
+  free(overwritten);
+  overwritten = NULL;
+  overwrittenCount = 0;
+  overwrittenCap = 0;
+}
+#endif
+
+void colorNewObject(Obj *object) {
+#ifdef CONCURRENT_GC
+  // allocated black, the snapshot the marker works from does not contain it
+  if (vm.gcPhase == GC_MARK) {
+    tryMarkObj(object);
+  }
+#else
+  // objects made while marking are traced like the roots, they may be handed
+  // the only reference to a white object before anyone shades it
+  if (vm.gcPhase == GC_MARK) {
+    tryMarkObj(object);
+    pushGray(object);
+  }
+#endif
+}
+
+static void startCycle() {
+  vm.metrics.gcCollections++;
+  vm.gcPhase = GC_MARK;
+  markRoots();
+#ifdef CONCURRENT_GC
+  wakeMarker();
+#endif
+}
 
+// true once the gray stack is empty
+static bool markSlice(int budget) {
+#ifdef CONCURRENT_GC
+  // the marker thread does the tracing
+  (void)budget;
+  return !isMarkerBusy();
+#else
+  while (budget > 0 && vm.grayCount > 0) {
+    blackenObject(vm.grayStack[--vm.grayCount]);
+    budget--;
+  }
+  return vm.grayCount == 0;
 #endif
+}
 
+#ifdef CONCURRENT_GC
+// the marker is idle, only references overwritten since it ran out of work
+// are left to trace, the weak string pool is cleared in the same pause
+static void finishMarking() {
+  markOverwritten();
+#else
+// the stack, the globals and the open upvalues have no barrier, they are
+// scanned again and what they reach is traced in one go, the weak string pool
+// is cleared in the same pause
+static void finishMarking() {
   markRoots();
+#endif
   traceReferences();
-  tableRemoveWhite(&vm.stringsPool);
+  removeWhiteStrings(&vm.stringsPool);
+  vm.sweepList = vm.objectHeap;
+  vm.objectHeap = NULL;
+  vm.gcPhase = GC_SWEEP;
+}
+
+static void finishCycle() {
+  vm.gcPhase = GC_IDLE;
+#ifdef SLAB_ALLOCATOR
+  trimSlabs();
+#endif
+  adaptGrowth();
+  paceCollections();
+}
+
+// traces or sweeps up to budget objects, the cycle moves on to the next phase
+// once the current one runs out of work, sweeping goes by whole segments so a
+// slice may go over budget by one segment
+static void step(int budget) {
+  if (vm.gcPhase == GC_MARK) {
+    if (!markSlice(budget)) {
+      return;
+    }
+    finishMarking();
+  }
+
+  while (budget > 0 && vm.sweepList != NULL) {
+    HeapSegment *segment = vm.sweepList;
+    vm.sweepList = segment->next;
+    budget -= segment->count;
+    sweepSegment(segment);
+    keepSegment(segment);
+  }
+  if (vm.sweepList == NULL) {
+    finishCycle();
+  }
+}
+
+static void collectSlice() {
+#ifdef CONCURRENT_GC
+  if (vm.gcPhase == GC_IDLE && !vm.markConcurrently) {
+    runGc();
+    return;
+  }
+#endif
+  double start = metricsClock();
+  isCollecting = true;
+  if (vm.gcPhase == GC_IDLE) {
+    startCycle();
+  }
+  step(vm.gcSliceBudget);
+  isCollecting = false;
+  recordPause(start);
+}
+
+static void completeCycle() {
+  while (vm.gcPhase != GC_IDLE) {
+#ifdef CONCURRENT_GC
+    waitForMarker();
+#endif
+    step(INT32_MAX);
+  }
+}
+#endif
+
+#ifdef COMPACTING_GC
+// objects moved out of the evacuated slabs, each now holds the address of
+// its copy, the originals are freed once nothing points at them
+static Obj **movedObjects = NULL;
+static int movedCount = 0;
+static int movedCap = 0;
+
+static void requestCompaction() {
+#ifdef DEBUG_STRESS_GC
+  bool isFragmented = true;
+#else
+  size_t mapped;
+  size_t unused;
+  slabUsage(&mapped, &unused);
+  bool isFragmented = unused * 100 > mapped * COMPACT_FRAGMENTATION;
+#endif
+  if (isFragmented) {
+    vm.compactRequested = true;
+    vm.gcRequested = true;
+  }
+}
+
+static Obj *moveObject(Obj *object) {
+  size_t size = objectSize(object);
+  Obj *copy = (Obj *)slabAllocateObject(size);
+  memcpy(copy, object, size);
+  followInteriorPointers(object, copy);
+  object->header = OBJ_FORWARDED;
+  setObjNext(object, copy);
+  GROW_GC_ARRAY(Obj *, movedObjects, movedCount, movedCap);
+  movedObjects[movedCount++] = object;
+  return copy;
+}
+
+// the copies take the places of the originals in the segment lists, they
+// keep their header so the lists stay linked through them
+static void evacuateSlabs() {
+  for (HeapSegment *segment = vm.objectHeap; segment != NULL;
+       segment = segment->next) {
+    Obj *previous = NULL;
+    Obj *object = segment->objects;
+    while (object != NULL) {
+      Obj *next = objNext(object);
+      if (isSlabEvacuating(object)) {
+        object = moveObject(object);
+        if (previous == NULL) {
+          segment->objects = object;
+        } else {
+          setObjNext(previous, object);
+        }
+      }
+      previous = object;
+      object = next;
+    }
+  }
+}
+
+static void forwardArray(ValueArray *array) {
+  for (int i = 0; i < array->count; i++) {
+    array->values[i] = forwardValue(array->values[i]);
+  }
+}
+
+static void forwardFields(Obj *object) {
+  switch (objType(object)) {
+  case OBJ_CLOSURE: {
+    ObjClosure *closure = (ObjClosure *)object;
+    closure->function = (ObjFunction *)forwardObj((Obj *)closure->function);
+    for (int i = 0; i < closure->upvalueCount; i++) {
+      closure->upvalues[i] =
+          (ObjUpvalue *)forwardObj((Obj *)closure->upvalues[i]);
+    }
+    break;
+  }
+  case OBJ_FUNCTION: {
+    ObjFunction *function = (ObjFunction *)object;
+    function->name = (ObjString *)forwardObj((Obj *)function->name);
+    forwardArray(&function->chunk.constants);
+    break;
+  }
+  case OBJ_UPVALUE:
+    // next is stale once the upvalue is closed, the open ones are fixed
+    // through vm.openUpvalues
+    ((ObjUpvalue *)object)->closed =
+        forwardValue(((ObjUpvalue *)object)->closed);
+    break;
+  case OBJ_STRING: {
+    ObjString *string = (ObjString *)object;
+    string->left = (ObjString *)forwardObj((Obj *)string->left);
+    string->right = (ObjString *)forwardObj((Obj *)string->right);
+    string->flat = (ObjString *)forwardObj((Obj *)string->flat);
+    break;
+  }
+  case OBJ_NATIVE:
+    break;
+  }
+}
+
+// everything markRoots() starts from, the compiler is not running at a
+// safepoint, and every object of the heap, garbage made since the last
+// collection included, it may only point at objects that are not freed yet
+static void forwardReferences() {
+  for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
+    *slot = forwardValue(*slot);
+  }
+  for (int i = 0; i < vm.frameCount; i++) {
+    vm.frames[i].closure =
+        (ObjClosure *)forwardObj((Obj *)vm.frames[i].closure);
+  }
+  // open upvalues point into the stack, which never moves with the objects
+  vm.openUpvalues = (ObjUpvalue *)forwardObj((Obj *)vm.openUpvalues);
+  for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL;
+       upvalue = upvalue->next) {
+    upvalue->next = (ObjUpvalue *)forwardObj((Obj *)upvalue->next);
+  }
+  forwardTable(&vm.globalSlots);
+  forwardArray(&vm.globalNames);
+  forwardArray(&vm.globalValues);
+  forwardInternedStrings(&vm.stringsPool);
+
+  for (HeapSegment *segment = vm.objectHeap; segment != NULL;
+       segment = segment->next) {
+    for (Obj *object = segment->objects; object != NULL;
+         object = objNext(object)) {
+      forwardFields(object);
+    }
+  }
+}
+
+// slab cells all have the size of their class, so live objects are not slid
+// towards one end of the heap, the sparse slabs are emptied into the dense
+// ones instead and given back to the os
+static void compactHeap() {
+  double start = metricsClock();
+#ifdef LAZY_SWEEP
+  // dead objects in unswept segments may point at freed ones and still have
+  // their mark bits set
+  completeLazySweep();
+#endif
+  vm.compactRequested = false;
+
+#ifdef DEBUG_STRESS_GC
+  bool everything = true;
+#else
+  bool everything = false;
+#endif
+  if (startSlabEvacuation(everything)) {
+    evacuateSlabs();
+    forwardReferences();
+    for (int i = 0; i < movedCount; i++) {
+      Obj *object = movedObjects[i];
+      slabFreeObject(object, objectSize(objNext(object)));
+    }
+    vm.metrics.gcMovedObjects += movedCount;
+    free(movedObjects);
+    movedObjects = NULL;
+    movedCount = 0;
+    movedCap = 0;
+    finishSlabEvacuation();
+    trimSlabs();
+  }
+
+  vm.metrics.gcCompactions++;
+  vm.metrics.gcCompactTime += metricsClock() - start;
+  recordPause(start);
+}
+#endif
+
+void runGc() {
+  double start = metricsClock();
+#ifdef INCREMENTAL_GC
+  // garbage made after a running cycle started is left for the next one, so
+  // the running cycle is finished first and a whole new one follows
+  isCollecting = true;
+  completeCycle();
+  startCycle();
+  completeCycle();
+  isCollecting = false;
+#else
+#ifdef LAZY_SWEEP
+  completeLazySweep();
+#endif
+#ifdef GENERATIONAL_GC
+  // the full collection below only knows the old generation
+  minorGc();
+#endif
+  vm.metrics.gcCollections++;
+
+  isCollecting = true;
+  double markStart = metricsClock();
+  markRoots();
+  traceReferences();
+  vm.metrics.gcMarkTime += metricsClock() - markStart;
+  removeWhiteStrings(&vm.stringsPool);
+#ifdef LAZY_SWEEP
+  // the garbage is still counted in bytesAllocated, finishLazySweep() paces
+  // the next collection again once it is gone
+  vm.sweepList = vm.objectHeap;
+  vm.objectHeap = NULL;
+#else
+  double sweepStart = metricsClock();
   sweep();
-  vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
-#ifdef DEBUG_LOG_STATS_GC
-  printf("-- gc end\n");
-  printf("   collected %zu bytes, alocated: %zu next at %zu\n",
-         before - vm.bytesAllocated, vm.bytesAllocated, vm.nextGC);
+#ifdef SLAB_ALLOCATOR
+  trimSlabs();
+#endif
+  vm.metrics.gcSweepTime += metricsClock() - sweepStart;
+#ifdef COMPACTING_GC
+  requestCompaction();
+#endif
+#endif
+  isCollecting = false;
+  adaptGrowth();
+  paceCollections();
+#endif
+  recordPause(start);
+}
+
+#if defined(GENERATIONAL_GC) || defined(COMPACTING_GC)
+void collectAtSafepoint() {
+  vm.gcRequested = false;
+#ifdef GENERATIONAL_GC
+#ifdef DEBUG_STRESS_GC
+  runGc();
+#else
+  // a disabled collector still empties the nursery once it spills
+  if (vm.bytesAllocated > vm.nextGC && (vm.gcEnabled || vm.heapExhausted)) {
+    runGc();
+  } else {
+    double start = metricsClock();
+    minorGc();
+    recordPause(start);
+    // promotions are not held against the limit while they happen
+    if (vm.heapLimit > 0 && vm.bytesAllocated > vm.heapLimit) {
+      runGc();
+    }
+  }
+#endif
+  if (vm.heapLimit > 0 && vm.bytesAllocated > vm.heapLimit) {
+    vm.heapExhausted = true;
+  }
+#endif
+#ifdef COMPACTING_GC
+  // the nursery is empty by now, only the mark-sweep heap has to be compacted
+  if (vm.compactRequested) {
+    compactHeap();
+  }
+#endif
+}
+#endif
+
+void collectGarbage() {
+  collectEverything();
+#ifdef COMPACTING_GC
+  if (vm.compactRequested) {
+    compactHeap();
+  }
+#endif
+}
+
+bool isHeapExhausted() {
+  vm.heapExhausted = false;
+  return vm.bytesAllocated > vm.heapLimit;
+}
+
+size_t heapSize() {
+  size_t size = vm.bytesAllocated;
+#ifdef GENERATIONAL_GC
+  for (NurseryBlock *block = vm.nursery; block != NULL; block = block->next) {
+    size += block->used;
+  }
 #endif
+  return size;
 }
@@ -2,6 +2,8 @@
 #define clox_memory_h
 
 #include "common.h"
+#include "object.h"
+#include "slab.h"
 #include "value.h"
 
 #define ALLOCATE(type, count)                                                  \
@@ -19,10 +21,214 @@
 #define FREE(type, pointer) (type *)reallocate(pointer, sizeof(type), 0);
 
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
+// memory for a new object, counted like reallocate() but taken from the
+// allocator that gives every object a mark bit
+void *allocateObjectMemory(size_t size);
+
+// the mark bits sit in a bitmap beside each slab, so marking writes to a few
+// cache lines instead of to every live object, without slabs the bit is in
+// the header, other threads mark at the same time under PARALLEL_GC and
+// CONCURRENT_GC so the bits are changed atomically there
+static inline uint64_t *markWordOfObj(Obj *object, uint64_t *bit) {
+#ifdef SLAB_ALLOCATOR
+  return markWordOf(object, bit);
+#else
+  *bit = OBJ_MARKED;
+  return (uint64_t *)&object->header;
+#endif
+}
+
+static inline bool isObjMarked(Obj *object) {
+  uint64_t bit;
+  uint64_t *word = markWordOfObj(object, &bit);
+  return (__atomic_load_n(word, __ATOMIC_RELAXED) & bit) != 0;
+}
+
+// false when the object was marked already
+static inline bool tryMarkObj(Obj *object) {
+  uint64_t bit;
+  uint64_t *word = markWordOfObj(object, &bit);
+  if ((__atomic_load_n(word, __ATOMIC_RELAXED) & bit) != 0) {
+    return false;
+  }
+#if defined(PARALLEL_GC) || defined(CONCURRENT_GC)
+  return (__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit) == 0;
+#else
+  *word |= bit;
+  return true;
+#endif
+}
+
+static inline void clearObjMark(Obj *object) {
+  uint64_t bit;
+  uint64_t *word = markWordOfObj(object, &bit);
+#if defined(PARALLEL_GC) || defined(CONCURRENT_GC)
+  __atomic_fetch_and(word, ~bit, __ATOMIC_RELAXED);
+#else
+  *word &= ~bit;
+#endif
+}
+
+// the first collection starts once the heap reaches this, nextGC never goes
+// below it
+#define GC_MIN_HEAP (1024 * 1024)
+// bounds of the factor the heap may grow by between full collections
+#define GC_GROWTH_MIN 1.5
+#define GC_GROWTH_MAX 8.0
+// the factor changes by at most this much after a collection
+#define GC_ADJUST_MIN 0.75
+#define GC_ADJUST_MAX 1.5
+// default share of the run time the collector aims to take, in percent, set
+// with --gc-target or CLOX_GC_TARGET
+#define GC_TARGET_PERCENT 10
 
 void freeObjectPool();
+// links a new object into the first heap segment
+void addToHeap(Obj *object);
 void runGc();
+// a full collection asked for by the script, natives are called where
+// objects may move, the collector runs even when disabled
+void collectGarbage();
+// called at a safepoint once an allocation went over heapLimit, true when
+// the collection that followed did not bring the heap back under it
+bool isHeapExhausted();
+// bytesAllocated plus the young objects, which are not counted there
+size_t heapSize();
 void markValue(Value value);
 void markObject(Obj* object);
 
+#ifdef PARALLEL_GC
+#define GC_MAX_THREADS 64
+#endif
+
+#if defined(GENERATIONAL_GC) || defined(COMPACTING_GC)
+// minor collection or compaction, plus a full collection when the heap has
+// passed nextGC, run() calls it only where no object pointer is held outside
+// the vm
+void collectAtSafepoint();
+
+// where an object lives after a collection moved it
+static inline Obj *forwardObj(Obj *object) {
+  if (object != NULL && hasObjFlag(object, OBJ_FORWARDED)) {
+    return objNext(object);
+  }
+  return object;
+}
+
+static inline Value forwardValue(Value value) {
+  if (IS_OBJ(value)) {
+    return OBJ_VAL(forwardObj(AS_OBJ(value)));
+  }
+  return value;
+}
+#endif
+
+#ifdef COMPACTING_GC
+// compactions start once this percentage of the slab memory is free cells in
+// slabs that are not full
+#define COMPACT_FRAGMENTATION 25
+#endif
+
+#ifdef GENERATIONAL_GC
+// size of the block young objects are bump allocated from
+#define NURSERY_BLOCK_SIZE (256 * 1024)
+// bigger objects are allocated in the old generation right away
+#define NURSERY_MAX_OBJECT (NURSERY_BLOCK_SIZE / 8)
+
+// NULL when the object has to be allocated in the old generation
+Obj *allocateYoung(size_t size);
+void rememberObject(Obj *object);
+void rememberGlobal(int slot);
+void rememberYoungString(ObjString *string);
+
+// every store of a reference into an old object goes through this, so minor
+// collections find young objects reachable only from the old generation
+#define WRITE_BARRIER(owner, value)                                            \
+  do {                                                                         \
+    if (!hasObjFlag(owner, OBJ_YOUNG | OBJ_REMEMBERED) && IS_OBJ(value) &&     \
+        hasObjFlag(AS_OBJ(value), OBJ_YOUNG)) {                                \
+      rememberObject(owner);                                                   \
+    }                                                                          \
+  } while (false)
+// globals are roots but only the slots given a young value are scanned, a
+// slot that already holds a young value was recorded when it got it
+#define GLOBAL_WRITE_BARRIER(slot, oldValue, newValue)                         \
+  do {                                                                         \
+    if (IS_OBJ(newValue) && hasObjFlag(AS_OBJ(newValue), OBJ_YOUNG) &&         \
+        !(IS_OBJ(oldValue) && hasObjFlag(AS_OBJ(oldValue), OBJ_YOUNG))) {      \
+      rememberGlobal(slot);                                                    \
+    }                                                                          \
+  } while (false)
+#define OVERWRITE_BARRIER(oldValue)                                            \
+  do {                                                                         \
+  } while (false)
+#define INTERN_BARRIER(string)                                                 \
+  do {                                                                         \
+  } while (false)
+#elif defined(INCREMENTAL_GC)
+// default number of gray objects traced, or objects swept, per slice
+#define GC_SLICE_BUDGET 1000
+
+// gives a new object the colour of the running cycle
+void colorNewObject(Obj *object);
+
+#ifdef CONCURRENT_GC
+void rememberOverwritten(Obj *object);
+
+// snapshot at the beginning: everything reachable when marking started
+// survives the cycle, so a reference about to be overwritten is handed to the
+// marker first, stores of new references need no barrier
+#define WRITE_BARRIER(owner, value)                                            \
+  do {                                                                         \
+  } while (false)
+#define OVERWRITE_BARRIER(oldValue)                                            \
+  do {                                                                         \
+    if (vm.gcPhase == GC_MARK && IS_OBJ(oldValue) &&                           \
+        !isObjMarked(AS_OBJ(oldValue))) {                                      \
+      rememberOverwritten(AS_OBJ(oldValue));                                   \
+    }                                                                          \
+  } while (false)
+// the intern pool is weak, a string found there may be garbage the snapshot
+// never reached, handing it out again makes it live, so it is marked like a
+// new object before the sweep can free it
+#define INTERN_BARRIER(string)                                                 \
+  do {                                                                         \
+    colorNewObject(&(string)->obj);                                            \
+  } while (false)
+#else
+// a black object must never point at a white one while marking, the stored
+// object is shaded gray instead, globals are roots and are rescanned before
+// marking ends
+#define WRITE_BARRIER(owner, value)                                            \
+  do {                                                                         \
+    if (vm.gcPhase == GC_MARK && isObjMarked(owner) && IS_OBJ(value) &&        \
+        !isObjMarked(AS_OBJ(value))) {                                         \
+      markObject(AS_OBJ(value));                                               \
+    }                                                                          \
+  } while (false)
+#define OVERWRITE_BARRIER(oldValue)                                            \
+  do {                                                                         \
+  } while (false)
+#define INTERN_BARRIER(string)                                                 \
+  do {                                                                         \
+  } while (false)
+#endif
+#define GLOBAL_WRITE_BARRIER(slot, oldValue, newValue)                         \
+  do {                                                                         \
+  } while (false)
+#else
+#define WRITE_BARRIER(owner, value)                                            \
+  do {                                                                         \
+  } while (false)
+#define GLOBAL_WRITE_BARRIER(slot, oldValue, newValue)                         \
+  do {                                                                         \
+  } while (false)
+#define OVERWRITE_BARRIER(oldValue)                                            \
+  do {                                                                         \
+  } while (false)
+#define INTERN_BARRIER(string)                                                 \
+  do {                                                                         \
+  } while (false)
+#endif
+
 #endif
@@ -0,0 +1,120 @@
+#include "metrics.h"
+#include "memory.h"
+#include "vm.h"
+#include <string.h>
+#include <time.h>
+
+#ifdef COMPACTING_GC
+#include "slab.h"
+#endif
+
+static const char *objectTypeNames[OBJ_TYPE_COUNT] = {
+    [OBJ_STRING] = "string",   [OBJ_FUNCTION] = "function",
+    [OBJ_CLOSURE] = "closure", [OBJ_UPVALUE] = "upvalue",
+    [OBJ_NATIVE] = "native",
+};
+
+void initMetrics(Metrics *metrics) { memset(metrics, 0, sizeof(Metrics)); }
+
+double metricsClock() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+void recordGcPause(Metrics *metrics, double pause) {
+  metrics->gcPauseCount++;
+  metrics->gcTotalPause += pause;
+  if (pause > metrics->gcMaxPause) {
+    metrics->gcMaxPause = pause;
+  }
+  int bucket = 0;
+  for (double bound = PAUSE_BUCKET_MIN;
+       bucket < PAUSE_BUCKETS - 1 && pause >= bound; bound *= 2) {
+    bucket++;
+  }
+  metrics->gcPauseHistogram[bucket]++;
+}
+
+static double milliseconds(double seconds) { return seconds * 1000; }
+
+static void writeGcMetrics(FILE *file, Metrics *metrics) {
+  fprintf(file, "  \"gc\": {\n");
+  fprintf(file, "    \"collections\": %d,\n", metrics->gcCollections);
+  fprintf(file, "    \"minorCollections\": %d,\n", metrics->gcMinorCollections);
+  fprintf(file, "    \"promotedBytes\": %llu,\n",
+          (unsigned long long)metrics->gcPromotedBytes);
+  fprintf(file, "    \"compactions\": %d,\n", metrics->gcCompactions);
+  fprintf(file, "    \"movedObjects\": %llu,\n",
+          (unsigned long long)metrics->gcMovedObjects);
+  fprintf(file, "    \"pauses\": %d,\n", metrics->gcPauseCount);
+  fprintf(file, "    \"pauseMaxMs\": %.3f,\n", milliseconds(metrics->gcMaxPause));
+  fprintf(file, "    \"pauseTotalMs\": %.3f,\n",
+          milliseconds(metrics->gcTotalPause));
+  // each bucket counts the pauses shorter than its bound and not shorter than
+  // the bound of the previous one
+  fprintf(file, "    \"pauseHistogram\": [");
+  double bound = PAUSE_BUCKET_MIN;
+  for (int i = 0; i < PAUSE_BUCKETS; i++, bound *= 2) {
+    if (i < PAUSE_BUCKETS - 1) {
+      fprintf(file, "{\"underMs\": %g, ", milliseconds(bound));
+    } else {
+      fprintf(file, "{\"underMs\": null, ");
+    }
+    fprintf(file, "\"count\": %llu}%s",
+            (unsigned long long)metrics->gcPauseHistogram[i],
+            i < PAUSE_BUCKETS - 1 ? ", " : "");
+  }
+  fprintf(file, "],\n");
+  fprintf(file, "    \"markMs\": %.3f,\n", milliseconds(metrics->gcMarkTime));
+  fprintf(file, "    \"sweepMs\": %.3f,\n", milliseconds(metrics->gcSweepTime));
+  fprintf(file, "    \"compactMs\": %.3f,\n",
+          milliseconds(metrics->gcCompactTime));
+  fprintf(file, "    \"growth\": %.2f,\n", vm.gcGrowth);
+  fprintf(file, "    \"nextCollection\": %zu\n", vm.nextGC);
+  fprintf(file, "  },\n");
+}
+
+void writeMetrics(FILE *file) {
+  Metrics *metrics = &vm.metrics;
+  fprintf(file, "{\n");
+  fprintf(file, "  \"instructions\": %llu,\n",
+          (unsigned long long)metrics->instructions);
+  fprintf(file, "  \"calls\": %llu,\n", (unsigned long long)metrics->calls);
+  fprintf(file, "  \"nativeCalls\": %llu,\n",
+          (unsigned long long)metrics->nativeCalls);
+
+  fprintf(file, "  \"phasesMs\": {\"scan\": %.3f, \"compile\": %.3f, "
+                "\"run\": %.3f},\n",
+          milliseconds(metrics->scanTime), milliseconds(metrics->compileTime),
+          milliseconds(metrics->runTime));
+
+  fprintf(file, "  \"objects\": {");
+  for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+    fprintf(file, "\"%s\": %llu%s", objectTypeNames[i],
+            (unsigned long long)metrics->objects[i],
+            i < OBJ_TYPE_COUNT - 1 ? ", " : "");
+  }
+  fprintf(file, "},\n");
+
+  fprintf(file, "  \"heap\": {\n");
+  fprintf(file, "    \"allocatedBytes\": %llu,\n",
+          (unsigned long long)metrics->bytesAllocated);
+  fprintf(file, "    \"freedBytes\": %llu,\n",
+          (unsigned long long)metrics->bytesFreed);
+  fprintf(file, "    \"size\": %zu,\n", heapSize());
+  fprintf(file, "    \"limit\": %zu", vm.heapLimit);
+#ifdef COMPACTING_GC
+  size_t mapped;
+  size_t unused;
+  slabUsage(&mapped, &unused);
+  fprintf(file, ",\n    \"slabBytes\": %zu,\n", mapped);
+  fprintf(file, "    \"unusedSlabBytes\": %zu", unused);
+#endif
+  fprintf(file, "\n  },\n");
+
+  writeGcMetrics(file, metrics);
+
+  fprintf(file, "  \"internedStrings\": %d\n", vm.stringsPool.count);
+  fprintf(file, "}\n");
+}
@@ -0,0 +1,68 @@
+#ifndef clox_metrics_h
+#define clox_metrics_h
+
+#include "common.h"
+#include "object.h"
+#include <stdio.h>
+
+// one token in SCAN_SAMPLE_INTERVAL is timed while scanning, reading the
+// clock around every token would cost more than scanning it
+#define SCAN_SAMPLE_INTERVAL 16
+
+// pauses are counted in buckets doubling from PAUSE_BUCKET_MIN seconds, the
+// last bucket takes everything longer
+#define PAUSE_BUCKETS 12
+#define PAUSE_BUCKET_MIN (1.0 / 16 / 1000)
+
+// counters kept by the vm whatever the build, they cost an increment where
+// the event happens and are only read when they are written out
+typedef struct {
+  uint64_t instructions;
+  // closure calls, tail calls included, and native calls
+  uint64_t calls;
+  uint64_t nativeCalls;
+  uint64_t objects[OBJ_TYPE_COUNT];
+  // every byte the heap was given or gave back since the vm started, the
+  // nursery is freed as a whole and its survivors are allocated again in the
+  // old generation
+  uint64_t bytesAllocated;
+  uint64_t bytesFreed;
+
+  // full collections, incremental cycles count once however many slices
+  // they take
+  int gcCollections;
+  int gcMinorCollections;
+  uint64_t gcPromotedBytes;
+  // time spent inside the collector, in seconds, one pause is a full
+  // collection or a single slice
+  int gcPauseCount;
+  double gcMaxPause;
+  double gcTotalPause;
+  uint64_t gcPauseHistogram[PAUSE_BUCKETS];
+  // part of the stop-the-world collections spent marking and sweeping, lazy
+  // sweeping is counted as it happens
+  double gcMarkTime;
+  double gcSweepTime;
+  // compactions run so far, the objects they moved and the time they took
+  int gcCompactions;
+  uint64_t gcMovedObjects;
+  double gcCompactTime;
+
+  // scanning happens on demand while compiling, it is not part of
+  // compileTime, estimated from the sampled tokens
+  double scanTime;
+  double compileTime;
+  double runTime;
+} Metrics;
+
+void initMetrics(Metrics *metrics);
+
+// wall clock seconds, cpu time would also count the work of the gc threads
+double metricsClock();
+
+void recordGcPause(Metrics *metrics, double pause);
+
+// the metrics of the vm and the current state of its heap as one JSON object
+void writeMetrics(FILE *file);
+
+#endif
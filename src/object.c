@@ -1,6 +1,7 @@
 #include "object.h"
 #include "chunk.h"
 #include "compiler.h"
+#include "hash.h"
 #include "hash_table.h"
 #include "memory.h"
 #include "value.h"
@@ -12,22 +13,25 @@
 #define ALLOCATE_OBJ(type, objectType)                                         \
   (type *)allocateObject(sizeof(type), objectType)
 
-static uint32_t hashString(const char *key, int length) {
-  uint32_t hash = 2166136261u;
-  for (int i = 0; i < length; i++) {
-    hash ^= (uint8_t)key[i];
-    hash *= 16777619;
-  }
-  return hash;
-}
-
 static Obj *allocateObject(size_t size, ObjType type) {
-  Obj *object = (Obj *)reallocate(NULL, 0, size);
+  vm.metrics.objects[type]++;
+#ifdef GENERATIONAL_GC
+  Obj *object = allocateYoung(size);
+  if (object != NULL) {
+    // young objects are found by walking the nursery, not through the list
+    object->header = (uintptr_t)type << OBJ_TYPE_SHIFT | OBJ_YOUNG;
+    return object;
+  }
+  object = (Obj *)allocateObjectMemory(size);
+#else
+  Obj *object = (Obj *)allocateObjectMemory(size);
+#endif
 
-  object->type = type;
-  object->next = vm.objectHeap;
-  object->isMarked = false;
-  vm.objectHeap = object;
+  object->header = (uintptr_t)type << OBJ_TYPE_SHIFT;
+  addToHeap(object);
+#ifdef INCREMENTAL_GC
+  colorNewObject(object);
+#endif
 
 #ifdef DEBUG_LOG_GC
   printf("%p allocate %zu for %d\n", (void *)object, size, type);
@@ -35,35 +39,37 @@ static Obj *allocateObject(size_t size, ObjType type) {
   return object;
 }
 
-static ObjString *allocateString(char *chars, int length, uint32_t hash) {
-  ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-  string->length = length;
-  string->chars = chars;
-  string->hash = hash;
+static void internNewString(ObjString *string) {
+  string->isInterned = true;
   push(OBJ_VAL(string));
-  setTableValue(&vm.stringsPool, string, NIL_VAL);
+  addInternedString(&vm.stringsPool, string);
+#ifdef GENERATIONAL_GC
+  if (hasObjFlag(&string->obj, OBJ_YOUNG)) {
+    rememberYoungString(string);
+  }
+#endif
   pop();
-  return string;
 }
 
 ObjFunction *newFunction() {
   ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
   function->arity = 0;
   function->upvalueCount = 0;
+  function->maxStack = 0;
   function->name = NULL;
   initChunk(&function->chunk);
   return function;
 }
 
 ObjClosure *newClosure(ObjFunction *function) {
-  ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue *, function->upvalueCount);
-  for (int i = 0; i < function->upvalueCount; i++) {
-    upvalues[i] = NULL;
-  }
-  ObjClosure *closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+  ObjClosure *closure = (ObjClosure *)allocateObject(
+      sizeof(ObjClosure) + sizeof(ObjUpvalue *) * function->upvalueCount,
+      OBJ_CLOSURE);
   closure->function = function;
-  closure->upvalues = upvalues;
   closure->upvalueCount = function->upvalueCount;
+  for (int i = 0; i < closure->upvalueCount; i++) {
+    closure->upvalues[i] = NULL;
+  }
   return closure;
 }
 
@@ -81,30 +87,186 @@ ObjNative *newNative(NativeFn function) {
   return native;
 }
 
+// a flat string with room for length characters, the caller fills chars and
+// hands it to finishRuntimeString or interns it
+ObjString *newString(int length) {
+  ObjString *string = (ObjString *)allocateObject(
+      sizeof(ObjString) + length + 1, OBJ_STRING);
+  string->length = length;
+  string->hash = 0;
+  string->isHashed = false;
+  string->isInterned = false;
+  string->left = NULL;
+  string->right = NULL;
+  string->flat = string;
+  string->chars[length] = '\0';
+  return string;
+}
+
 ObjString *copyString(const char *string, int length) {
-  uint32_t hash = hashString(string, length);
+  uint32_t hash = hashBytes(string, length);
   ObjString *stringFromPool =
-      findTableString(&vm.stringsPool, string, length, hash);
+      findInternedString(&vm.stringsPool, string, length, hash);
 
   if (stringFromPool != NULL) {
+    INTERN_BARRIER(stringFromPool);
     return stringFromPool;
   }
 
-  char *heapChars = ALLOCATE(char, length + 1);
-  memcpy(heapChars, string, length);
-  heapChars[length] = '\0';
-  return allocateString(heapChars, length, hash);
+  ObjString *result = newString(length);
+  memcpy(result->chars, string, length);
+  result->hash = hash;
+  result->isHashed = true;
+  internNewString(result);
+  return result;
+}
+
+// strings made by the running program, most of them are intermediate results
+// that die right away, so they are not interned unless LAZY_INTERNING is off
+ObjString *finishRuntimeString(ObjString *string) {
+#ifdef LAZY_INTERNING
+  return string;
+#else
+  return internString(string);
+#endif
+}
+
+ObjString *copyRuntimeString(const char *string, int length) {
+  ObjString *result = newString(length);
+  memcpy(result->chars, string, length);
+  return finishRuntimeString(result);
+}
+
+static ObjString *newRope(ObjString *left, ObjString *right) {
+  ObjString *rope = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+  rope->length = left->length + right->length;
+  rope->hash = 0;
+  rope->isHashed = false;
+  rope->isInterned = false;
+  rope->left = left;
+  rope->right = right;
+  rope->flat = NULL;
+  return rope;
 }
 
-ObjString *takeString(char *string, int length) {
-  uint32_t hash = hashString(string, length);
+// both strings must stay reachable from the vm stack while this allocates
+ObjString *concatStrings(ObjString *lhs, ObjString *rhs) {
+  if (lhs->length == 0) {
+    return rhs;
+  }
+  if (rhs->length == 0) {
+    return lhs;
+  }
+
+  int length = lhs->length + rhs->length;
+  if (length >= ROPE_MIN_LENGTH) {
+    // copying and hashing is deferred until the contents are needed, so
+    // building a string piece by piece stays linear
+    return newRope(lhs, rhs);
+  }
+
+  // ropes are never shorter than ROPE_MIN_LENGTH, so both halves are flat and
+  // are copied straight into the new string
+  ObjString *result = newString(length);
+  memcpy(result->chars, lhs->chars, lhs->length);
+  memcpy(result->chars + lhs->length, rhs->chars, rhs->length);
+  return finishRuntimeString(result);
+}
+
+// returns the flat string holding the characters of string, the string must
+// be reachable from the vm stack
+ObjString *flattenString(ObjString *string) {
+  if (string->flat != NULL) {
+    return string->flat;
+  }
+
+  push(OBJ_VAL(string));
+  ObjString *flat = newString(string->length);
+  push(OBJ_VAL(flat));
+
+  // leaves are copied right to left, so a left-leaning rope, the shape a
+  // string builder loop produces, never has more than two pending nodes
+  int pendingCap = 8;
+  int pendingCount = 0;
+  ObjString **pending = ALLOCATE(ObjString *, pendingCap);
+  pending[pendingCount++] = string;
+  int end = string->length;
+  while (pendingCount > 0) {
+    ObjString *node = pending[--pendingCount];
+    if (node->flat != NULL) {
+      end -= node->length;
+      memcpy(flat->chars + end, node->flat->chars, node->length);
+      continue;
+    }
+    if (pendingCount + 2 > pendingCap) {
+      int oldCap = pendingCap;
+      pendingCap = GROW_CAPACITY(oldCap);
+      pending = GROW_ARRAY(ObjString *, pending, oldCap, pendingCap);
+    }
+    pending[pendingCount++] = node->left;
+    pending[pendingCount++] = node->right;
+  }
+  FREE_ARRAY(ObjString *, pending, pendingCap);
+
+  WRITE_BARRIER(&string->obj, OBJ_VAL(flat));
+  string->flat = flat;
+  string->left = NULL;
+  string->right = NULL;
+  pop();
+  pop();
+  return flat;
+}
+
+// ropes are flattened first, so the string must be reachable from the vm
+// stack
+uint32_t stringHash(ObjString *string) {
+  if (!string->isHashed) {
+    ObjString *flat = flattenString(string);
+    string->hash = hashBytes(flat->chars, flat->length);
+    string->isHashed = true;
+  }
+  return string->hash;
+}
+
+// returns the pooled string with the same contents, a flat string joins the
+// pool itself if there is none yet, tables compare keys by pointer so every
+// key goes through here
+ObjString *internString(ObjString *string) {
+  if (string->isInterned) {
+    return string;
+  }
+  push(OBJ_VAL(string));
+  ObjString *flat = flattenString(string);
+  uint32_t hash = stringHash(flat);
   ObjString *stringFromPool =
-      findTableString(&vm.stringsPool, string, length, hash);
-  if (stringFromPool != NULL) {
-    FREE_ARRAY(char, string, length + 1);
-    return stringFromPool;
+      findInternedString(&vm.stringsPool, flat->chars, flat->length, hash);
+  if (stringFromPool == NULL) {
+    internNewString(flat);
+    stringFromPool = flat;
+  } else {
+    INTERN_BARRIER(stringFromPool);
+  }
+  pop();
+  return stringFromPool;
+}
+
+// both strings must stay reachable from the vm stack, ropes are flattened
+bool stringsEqual(ObjString *a, ObjString *b) {
+  if (a == b) {
+    return true;
+  }
+  if (a->isInterned && b->isInterned) {
+    return false;
+  }
+  if (a->length != b->length) {
+    return false;
+  }
+  // an interned string may still equal one that never went through the pool
+  if (stringHash(a) != stringHash(b)) {
+    return false;
   }
-  return allocateString(string, length, hash);
+  // hashing flattened both sides
+  return memcmp(a->flat->chars, b->flat->chars, a->length) == 0;
 }
 
 static void printFunction(ObjFunction *function) {
@@ -141,10 +303,15 @@ void printValueObject(Value value) {
 }
 
 void printObject(Obj *object) {
-  switch (object->type) {
+  switch (objType(object)) {
   case OBJ_STRING: {
+    // no flattening here, this runs while the gc walks the heap
     ObjString *str = (ObjString *)object;
-    printf("%s", str->chars);
+    if (str->flat == NULL) {
+      printf("<rope %d>", str->length);
+    } else {
+      printf("%s", str->flat->chars);
+    }
     break;
   }
   case OBJ_NATIVE: {
@@ -6,7 +6,7 @@
 #include "value.h"
 #include <_types/_uint32_t.h>
 
-#define OBJ_TYPE(value) (AS_OBJ(value)->type)
+#define OBJ_TYPE(value) (objType(AS_OBJ(value)))
 
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
@@ -16,7 +16,7 @@
 #define AS_STRING(value) ((ObjString *)AS_OBJ(value))
 #define AS_FUNCTION(value) ((ObjFunction *)AS_OBJ(value))
 #define AS_CLOSURE(value) ((ObjClosure *)AS_OBJ(value))
-#define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
+#define AS_CSTRING(value) (flattenString(AS_STRING(value))->chars)
 #define AS_NATIVE(value) (((ObjNative *)AS_OBJ(value))->function)
 
 typedef enum {
@@ -27,23 +27,90 @@ typedef enum {
   OBJ_NATIVE
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_NATIVE + 1)
+
+// the whole header is one word: the next object of the heap segment in the
+// low bits and the type and flags in the top byte, user space addresses never
+// reach it, with slabs the mark bits live outside the object, see
+// isObjMarked()
 struct Obj {
-  ObjType type;
-  bool isMarked;
-  struct Obj *next;
+  uintptr_t header;
 };
 
+#define OBJ_NEXT_MASK (((uintptr_t)1 << 56) - 1)
+#define OBJ_TYPE_SHIFT 56
+#define OBJ_TYPE_MASK ((uintptr_t)7 << OBJ_TYPE_SHIFT)
+#define OBJ_YOUNG ((uintptr_t)1 << 59)
+// an old object already queued for the next minor collection to scan
+#define OBJ_REMEMBERED ((uintptr_t)1 << 60)
+// a young object copied out of the nursery, next points at the copy
+#define OBJ_FORWARDED ((uintptr_t)1 << 61)
+// the mark bit when objects don't come from slabs
+#define OBJ_MARKED ((uintptr_t)1 << 62)
+
+// without slabs the collector threads set OBJ_MARKED while others read the
+// type of the same object
+static inline uintptr_t objHeader(Obj *object) {
+#if !defined(SLAB_ALLOCATOR) && (defined(PARALLEL_GC) || defined(CONCURRENT_GC))
+  return __atomic_load_n(&object->header, __ATOMIC_RELAXED);
+#else
+  return object->header;
+#endif
+}
+
+static inline ObjType objType(Obj *object) {
+  return (ObjType)((objHeader(object) & OBJ_TYPE_MASK) >> OBJ_TYPE_SHIFT);
+}
+
+static inline Obj *objNext(Obj *object) {
+  return (Obj *)(objHeader(object) & OBJ_NEXT_MASK);
+}
+
+static inline void setObjNext(Obj *object, Obj *next) {
+  object->header = (object->header & ~OBJ_NEXT_MASK) | (uintptr_t)next;
+}
+
+static inline bool hasObjFlag(Obj *object, uintptr_t flag) {
+  return (object->header & flag) != 0;
+}
+
+static inline void setObjFlag(Obj *object, uintptr_t flag) {
+  object->header |= flag;
+}
+
+static inline void clearObjFlag(Obj *object, uintptr_t flag) {
+  object->header &= ~flag;
+}
+
+// concatenations at least this long are built as ropes
+#define ROPE_MIN_LENGTH 64
+
 struct ObjString {
   Obj obj;
   int length;
-  char *chars;
+  // valid only once isHashed is set, see stringHash
   uint32_t hash;
+  bool isHashed;
+  // interned strings are unique per content, everything else is compared by
+  // content
+  bool isInterned;
+  // a rope is the lazy concatenation of left and right, flattening drops both
+  // children and points flat at a string holding the characters, flat strings
+  // point at themselves
+  struct ObjString *left;
+  struct ObjString *right;
+  struct ObjString *flat;
+  // allocated together with the header, empty for rope nodes
+  char chars[];
 };
 
 typedef struct {
   Obj obj;
   int arity;
   int upvalueCount;
+  // stack slots a call needs from its callee slot on, the callee and the
+  // arguments included
+  int maxStack;
   Chunk chunk;
   ObjString *name;
 } ObjFunction;
@@ -58,8 +125,9 @@ typedef struct ObjUpvalue {
 typedef struct {
   Obj obj;
   ObjFunction *function;
-  ObjUpvalue **upvalues;
   int upvalueCount;
+  // allocated together with the closure
+  ObjUpvalue *upvalues[];
 } ObjClosure;
 
 typedef Value (*NativeFn)(int argCount, Value *args);
@@ -70,11 +138,18 @@ typedef struct {
 } ObjNative;
 
 static inline bool isObjType(Value value, ObjType type) {
-  return IS_OBJ(value) && AS_OBJ(value)->type == type;
+  return IS_OBJ(value) && objType(AS_OBJ(value)) == type;
 }
 
-ObjString *takeString(char *string, int length);
 ObjString *copyString(const char *string, int length);
+ObjString *newString(int length);
+ObjString *finishRuntimeString(ObjString *string);
+ObjString *copyRuntimeString(const char *string, int length);
+ObjString *concatStrings(ObjString *lhs, ObjString *rhs);
+ObjString *flattenString(ObjString *string);
+uint32_t stringHash(ObjString *string);
+ObjString *internString(ObjString *string);
+bool stringsEqual(ObjString *a, ObjString *b);
 ObjFunction *newFunction();
 ObjClosure *newClosure(ObjFunction *function);
 ObjUpvalue *newUpvalue(Value *slot);
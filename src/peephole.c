@@ -0,0 +1,356 @@
+#include "peephole.h"
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+// the chunk is decoded into a list of instructions, fused instructions take
+// over the first instruction of the sequence and mark the rest as removed,
+// then the list is encoded back with jump offsets and lines recomputed
+typedef struct {
+  // offset and size of the instruction in the original code
+  int offset;
+  int size;
+  int line;
+  uint8_t op;
+  // operands of a rewritten instruction, the original bytes are used
+  // otherwise
+  bool isRewritten;
+  uint8_t operandCount;
+  uint8_t operands[2];
+  // index of the instruction a jump lands on, -1 if it is not a jump
+  int target;
+  // number of jumps landing on this instruction
+  int jumpsIn;
+  bool isRemoved;
+} Instruction;
+
+typedef struct {
+  Chunk *chunk;
+  Instruction *code;
+  int count;
+} Peephole;
+
+static bool isJump(uint8_t op) {
+  switch (op) {
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_LOOP:
+  case OP_POP_JUMP_IF_FALSE:
+  case OP_JUMP_IF_NOT_EQUAL:
+  case OP_JUMP_IF_EQUAL:
+  case OP_JUMP_IF_NOT_LESS:
+  case OP_JUMP_IF_NOT_LESS_EQUAL:
+  case OP_JUMP_IF_NOT_GREATER:
+  case OP_JUMP_IF_NOT_GREATER_EQUAL:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static int nextInstruction(Peephole *peephole, int idx) {
+  do {
+    idx++;
+  } while (idx < peephole->count && peephole->code[idx].isRemoved);
+  return idx;
+}
+
+static int prevInstruction(Peephole *peephole, int idx) {
+  do {
+    idx--;
+  } while (idx >= 0 && peephole->code[idx].isRemoved);
+  return idx;
+}
+
+static uint8_t opAt(Peephole *peephole, int idx) {
+  // the end of the chunk behaves like an instruction nothing can fuse with
+  return idx < peephole->count ? peephole->code[idx].op : OP_RETURN;
+}
+
+// an instruction can be swallowed by the one before it only if no jump lands
+// in the middle of the fused sequence
+static bool canAbsorb(Peephole *peephole, int idx) {
+  return idx < peephole->count && peephole->code[idx].jumpsIn == 0;
+}
+
+static void removeInstruction(Peephole *peephole, int idx) {
+  Instruction *instruction = &peephole->code[idx];
+  instruction->isRemoved = true;
+  // jumps to a removed instruction land on the one after it
+  int next = nextInstruction(peephole, idx);
+  if (next < peephole->count) {
+    peephole->code[next].jumpsIn += instruction->jumpsIn;
+  }
+}
+
+static void rewrite(Instruction *instruction, uint8_t op, int operandCount,
+                    uint8_t first, uint8_t second) {
+  instruction->op = op;
+  instruction->isRewritten = true;
+  instruction->operandCount = operandCount;
+  instruction->operands[0] = first;
+  instruction->operands[1] = second;
+}
+
+static uint8_t operandOf(Peephole *peephole, int idx) {
+  return peephole->chunk->code[peephole->code[idx].offset + 1];
+}
+
+// JUMP_IF_FALSE, POP where the jump lands on a POP that nothing else reaches
+// becomes a single POP_JUMP_IF_FALSE, both pops are folded into it
+static bool fuseConditionalJump(Peephole *peephole, int idx) {
+  Instruction *jump = &peephole->code[idx];
+  if (jump->op != OP_JUMP_IF_FALSE) {
+    return false;
+  }
+  int pop = nextInstruction(peephole, idx);
+  if (opAt(peephole, pop) != OP_POP || !canAbsorb(peephole, pop)) {
+    return false;
+  }
+
+  int target = jump->target;
+  if (target >= peephole->count || peephole->code[target].isRemoved ||
+      peephole->code[target].op != OP_POP ||
+      peephole->code[target].jumpsIn != 1) {
+    return false;
+  }
+  // the target pop must not be reachable by falling through
+  int beforeTarget = prevInstruction(peephole, target);
+  if (beforeTarget < 0) {
+    return false;
+  }
+  uint8_t beforeOp = peephole->code[beforeTarget].op;
+  if (beforeOp != OP_JUMP && beforeOp != OP_LOOP && beforeOp != OP_RETURN) {
+    return false;
+  }
+
+  jump->op = OP_POP_JUMP_IF_FALSE;
+  removeInstruction(peephole, pop);
+  removeInstruction(peephole, target);
+  return true;
+}
+
+static uint8_t negatedComparison(uint8_t op) {
+  switch (op) {
+  case OP_EQUAL:
+    return OP_NOT_EQUAL;
+  case OP_GREATER:
+    return OP_LESS_EQUAL;
+  case OP_LESS:
+    return OP_GREATER_EQUAL;
+  default:
+    return OP_RETURN;
+  }
+}
+
+static uint8_t compareAndJump(uint8_t op) {
+  switch (op) {
+  case OP_EQUAL:
+    return OP_JUMP_IF_NOT_EQUAL;
+  case OP_NOT_EQUAL:
+    return OP_JUMP_IF_EQUAL;
+  case OP_LESS:
+    return OP_JUMP_IF_NOT_LESS;
+  case OP_LESS_EQUAL:
+    return OP_JUMP_IF_NOT_LESS_EQUAL;
+  case OP_GREATER:
+    return OP_JUMP_IF_NOT_GREATER;
+  case OP_GREATER_EQUAL:
+    return OP_JUMP_IF_NOT_GREATER_EQUAL;
+  default:
+    return OP_RETURN;
+  }
+}
+
+static bool fuse(Peephole *peephole, int idx) {
+  Instruction *instruction = &peephole->code[idx];
+  int next = nextInstruction(peephole, idx);
+  if (!canAbsorb(peephole, next)) {
+    return false;
+  }
+  uint8_t nextOp = opAt(peephole, next);
+
+  switch (instruction->op) {
+  case OP_EQUAL:
+  case OP_GREATER:
+  case OP_LESS:
+    // <=, >= and != are compiled as a comparison followed by a NOT
+    if (nextOp == OP_NOT) {
+      instruction->op = negatedComparison(instruction->op);
+      removeInstruction(peephole, next);
+      return true;
+    }
+    // fall through
+  case OP_NOT_EQUAL:
+  case OP_LESS_EQUAL:
+  case OP_GREATER_EQUAL:
+    if (nextOp == OP_POP_JUMP_IF_FALSE) {
+      instruction->op = compareAndJump(instruction->op);
+      instruction->target = peephole->code[next].target;
+      removeInstruction(peephole, next);
+      return true;
+    }
+    return false;
+  case OP_GET_LOCAL: {
+    uint8_t slot = operandOf(peephole, idx);
+    if (nextOp == OP_GET_LOCAL) {
+      rewrite(instruction, OP_GET_LOCAL_2, 2, slot, operandOf(peephole, next));
+      removeInstruction(peephole, next);
+      return true;
+    }
+    int arithmetic = nextInstruction(peephole, next);
+    uint8_t arithmeticOp = opAt(peephole, arithmetic);
+    if (nextOp != OP_CONSTANT || !canAbsorb(peephole, arithmetic) ||
+        (arithmeticOp != OP_ADD && arithmeticOp != OP_SUBTRACT)) {
+      return false;
+    }
+    uint8_t constant = operandOf(peephole, next);
+    if (!IS_NUMBER(peephole->chunk->constants.values[constant])) {
+      return false;
+    }
+    rewrite(instruction,
+            arithmeticOp == OP_ADD ? OP_ADD_LOCAL_CONST
+                                   : OP_SUBTRACT_LOCAL_CONST,
+            2, slot, constant);
+    // runtime errors are reported on the line of the arithmetic
+    instruction->line = peephole->code[arithmetic].line;
+    removeInstruction(peephole, next);
+    removeInstruction(peephole, arithmetic);
+    return true;
+  }
+  default:
+    return false;
+  }
+}
+
+static int encodedSize(Instruction *instruction) {
+  if (isJump(instruction->op)) {
+    return 3;
+  }
+  if (instruction->isRewritten) {
+    return 1 + instruction->operandCount;
+  }
+  return instruction->size;
+}
+
+static void encode(Peephole *peephole) {
+  Chunk *chunk = peephole->chunk;
+  int *newOffsets = ALLOCATE(int, peephole->count + 1);
+  int newCount = 0;
+  for (int i = 0; i < peephole->count; i++) {
+    newOffsets[i] = newCount;
+    if (!peephole->code[i].isRemoved) {
+      newCount += encodedSize(&peephole->code[i]);
+    }
+  }
+  newOffsets[peephole->count] = newCount;
+
+  uint8_t *code = ALLOCATE(uint8_t, newCount);
+  int *lines = ALLOCATE(int, newCount);
+  int offset = 0;
+  for (int i = 0; i < peephole->count; i++) {
+    Instruction *instruction = &peephole->code[i];
+    if (instruction->isRemoved) {
+      continue;
+    }
+    int size = encodedSize(instruction);
+    if (isJump(instruction->op)) {
+      // removed instructions keep their offset, which is the offset of the
+      // next instruction that survived
+      int target = newOffsets[instruction->target];
+      int jump = instruction->op == OP_LOOP ? offset + 3 - target
+                                            : target - offset - 3;
+      code[offset] = instruction->op;
+      code[offset + 1] = (jump >> 8) & 0xff;
+      code[offset + 2] = jump & 0xff;
+    } else if (instruction->isRewritten) {
+      code[offset] = instruction->op;
+      memcpy(code + offset + 1, instruction->operands,
+             instruction->operandCount);
+    } else {
+      // fusing may have changed just the opcode
+      memcpy(code + offset, chunk->code + instruction->offset, size);
+      code[offset] = instruction->op;
+    }
+    for (int j = 0; j < size; j++) {
+      lines[offset + j] = instruction->line;
+    }
+    offset += size;
+  }
+
+  // the optimized code is never longer, so it fits into the chunk arrays
+  memcpy(chunk->code, code, newCount);
+  memcpy(chunk->lines, lines, sizeof(int) * newCount);
+  chunk->count = newCount;
+
+  FREE_ARRAY(uint8_t, code, newCount);
+  FREE_ARRAY(int, lines, newCount);
+  FREE_ARRAY(int, newOffsets, peephole->count + 1);
+}
+
+void peepholeOptimize(Chunk *chunk) {
+  int codeCount = chunk->count;
+  int count = 0;
+  for (int offset = 0; offset < chunk->count;
+       offset += instructionSize(chunk, offset)) {
+    count++;
+  }
+
+  Peephole peephole;
+  peephole.chunk = chunk;
+  peephole.count = count;
+  peephole.code = ALLOCATE(Instruction, count);
+  int *indexAt = ALLOCATE(int, codeCount + 1);
+
+  int idx = 0;
+  for (int offset = 0; offset < chunk->count; idx++) {
+    Instruction *instruction = &peephole.code[idx];
+    instruction->offset = offset;
+    instruction->size = instructionSize(chunk, offset);
+    instruction->line = chunk->lines[offset];
+    instruction->op = chunk->code[offset];
+    instruction->isRewritten = false;
+    instruction->operandCount = 0;
+    instruction->target = -1;
+    instruction->jumpsIn = 0;
+    instruction->isRemoved = false;
+    indexAt[offset] = idx;
+    offset += instruction->size;
+  }
+  indexAt[chunk->count] = count;
+
+  for (int i = 0; i < count; i++) {
+    Instruction *instruction = &peephole.code[i];
+    if (!isJump(instruction->op)) {
+      continue;
+    }
+    uint16_t jump = (uint16_t)(chunk->code[instruction->offset + 1] << 8 |
+                               chunk->code[instruction->offset + 2]);
+    int target = instruction->op == OP_LOOP
+                     ? instruction->offset + 3 - jump
+                     : instruction->offset + 3 + jump;
+    instruction->target = indexAt[target];
+    if (instruction->target < count) {
+      peephole.code[instruction->target].jumpsIn++;
+    }
+  }
+
+  // conditional jumps are fused first, so that comparisons can merge with
+  // the result in the second pass
+  for (int i = 0; i < count; i = nextInstruction(&peephole, i)) {
+    fuseConditionalJump(&peephole, i);
+  }
+  for (int i = 0; i < count; i = nextInstruction(&peephole, i)) {
+    while (fuse(&peephole, i)) {
+    }
+  }
+
+  encode(&peephole);
+
+  FREE_ARRAY(int, indexAt, codeCount + 1);
+  FREE_ARRAY(Instruction, peephole.code, count);
+}
@@ -0,0 +1,10 @@
+#ifndef clox_peephole_h
+#define clox_peephole_h
+
+#include "chunk.h"
+
+// rewrites common instruction sequences of a finished chunk into
+// superinstructions, jump offsets and lines are fixed up to match
+void peepholeOptimize(Chunk *chunk);
+
+#endif
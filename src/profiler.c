@@ -0,0 +1,203 @@
+#include "profiler.h"
+#include "hash.h"
+#include "object.h"
+#include "vm.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+volatile sig_atomic_t pendingSamples = 0;
+
+// every distinct stack seen so far, the frames are resolved to text when the
+// sample is taken, functions may be moved or freed by the gc afterwards
+typedef struct {
+  char *stack;
+  uint32_t hash;
+  uint64_t count;
+} ProfileEntry;
+
+static ProfileEntry *entries = NULL;
+static int entryCount = 0;
+static int entryCapacity = 0;
+
+static FILE *profileFile = NULL;
+
+static char *sampleBuffer = NULL;
+static size_t sampleLength = 0;
+static size_t sampleCapacity = 0;
+
+// only async signal safe work here
+static void onProfileTick(int sig) {
+  (void)sig;
+  int savedErrno = errno;
+  __atomic_fetch_add(&pendingSamples, 1, __ATOMIC_RELAXED);
+  errno = savedErrno;
+}
+
+void startProfiler(const char *path, int rate) {
+  profileFile = fopen(path, "w");
+  if (profileFile == NULL) {
+    fprintf(stderr, "Could not open file \"%s\".\n", path);
+    exit(74);
+  }
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = onProfileTick;
+  sigemptyset(&action.sa_mask);
+  // reads and writes of the script go on where the tick interrupted them
+  action.sa_flags = SA_RESTART;
+  sigaction(SIGPROF, &action, NULL);
+
+  struct itimerval timer;
+  timer.it_interval.tv_sec = 0;
+  timer.it_interval.tv_usec = rate >= 1000000 ? 1 : 1000000 / rate;
+  timer.it_value = timer.it_interval;
+  setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+static void appendSample(const char *chars, size_t length) {
+  if (length == 0) {
+    return;
+  }
+  if (sampleLength + length + 1 > sampleCapacity) {
+    while (sampleLength + length + 1 > sampleCapacity) {
+      sampleCapacity = sampleCapacity < 256 ? 256 : sampleCapacity * 2;
+    }
+    sampleBuffer = (char *)realloc(sampleBuffer, sampleCapacity);
+    if (sampleBuffer == NULL) {
+      exit(1);
+    }
+  }
+  memcpy(sampleBuffer + sampleLength, chars, length);
+  sampleLength += length;
+  sampleBuffer[sampleLength] = '\0';
+}
+
+static void appendFrame(CallFrame *frame) {
+  ObjFunction *function = frame->closure->function;
+  // ip already points past the instruction being executed, every safepoint
+  // is reached after at least one byte of it was read
+  int line = function->chunk.lines[frame->ip - function->chunk.code - 1];
+  if (function->name == NULL) {
+    appendSample("script", 6);
+  } else {
+    appendSample(function->name->chars, function->name->length);
+  }
+  char number[16];
+  int length = snprintf(number, sizeof(number), ":%d", line);
+  appendSample(number, length);
+}
+
+static void growEntries() {
+  int oldCapacity = entryCapacity;
+  ProfileEntry *oldEntries = entries;
+  entryCapacity = oldCapacity < 64 ? 64 : oldCapacity * 2;
+  entries = (ProfileEntry *)calloc(entryCapacity, sizeof(ProfileEntry));
+  if (entries == NULL) {
+    exit(1);
+  }
+  for (int i = 0; i < oldCapacity; i++) {
+    if (oldEntries[i].stack == NULL) {
+      continue;
+    }
+    int index = oldEntries[i].hash & (entryCapacity - 1);
+    while (entries[index].stack != NULL) {
+      index = (index + 1) & (entryCapacity - 1);
+    }
+    entries[index] = oldEntries[i];
+  }
+  free(oldEntries);
+}
+
+static void countStack(const char *stack, size_t length, uint64_t count) {
+  // kept at most half full
+  if ((entryCount + 1) * 2 > entryCapacity) {
+    growEntries();
+  }
+  uint32_t hash = hashBytes(stack, (int)length);
+  int index = hash & (entryCapacity - 1);
+  while (entries[index].stack != NULL) {
+    if (entries[index].hash == hash &&
+        strcmp(entries[index].stack, stack) == 0) {
+      entries[index].count += count;
+      return;
+    }
+    index = (index + 1) & (entryCapacity - 1);
+  }
+  entries[index].stack = (char *)malloc(length + 1);
+  if (entries[index].stack == NULL) {
+    exit(1);
+  }
+  memcpy(entries[index].stack, stack, length + 1);
+  entries[index].hash = hash;
+  entries[index].count = count;
+  entryCount++;
+}
+
+void takeSample() {
+  // ticks arriving from here on are left for the next sample
+  int count = __atomic_exchange_n(&pendingSamples, 0, __ATOMIC_RELAXED);
+
+  sampleLength = 0;
+  int first = 0;
+  if (vm.frameCount > PROFILE_MAX_DEPTH) {
+    first = vm.frameCount - PROFILE_MAX_DEPTH;
+    appendSample("[truncated];", 12);
+  }
+  for (int i = first; i < vm.frameCount; i++) {
+    if (i > first) {
+      appendSample(";", 1);
+    }
+    appendFrame(&vm.frames[i]);
+  }
+  countStack(sampleBuffer, sampleLength, count);
+}
+
+void stopProfiler() {
+  struct itimerval timer;
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, NULL);
+  signal(SIGPROF, SIG_IGN);
+  // compiling and the collection at the end of the script have no frames
+  int count = __atomic_exchange_n(&pendingSamples, 0, __ATOMIC_RELAXED);
+  if (count > 0) {
+    countStack("[vm]", 4, count);
+  }
+}
+
+static int compareEntries(const void *a, const void *b) {
+  return strcmp(((const ProfileEntry *)a)->stack,
+                ((const ProfileEntry *)b)->stack);
+}
+
+void writeProfile() {
+  // the empty slots go last, the rest is sorted so runs are easy to compare
+  int used = 0;
+  for (int i = 0; i < entryCapacity; i++) {
+    if (entries[i].stack != NULL) {
+      entries[used++] = entries[i];
+    }
+  }
+  if (used > 0) {
+    qsort(entries, used, sizeof(ProfileEntry), compareEntries);
+  }
+  for (int i = 0; i < used; i++) {
+    fprintf(profileFile, "%s %llu\n", entries[i].stack,
+            (unsigned long long)entries[i].count);
+    free(entries[i].stack);
+  }
+  fclose(profileFile);
+  profileFile = NULL;
+
+  free(entries);
+  entries = NULL;
+  entryCount = 0;
+  entryCapacity = 0;
+  free(sampleBuffer);
+  sampleBuffer = NULL;
+  sampleLength = 0;
+  sampleCapacity = 0;
+}
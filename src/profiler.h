@@ -0,0 +1,35 @@
+#ifndef clox_profiler_h
+#define clox_profiler_h
+
+#include "common.h"
+#include <signal.h>
+
+// samples taken per second of cpu time, change it with --profile-rate
+#define PROFILE_RATE 1000
+// frames kept from the innermost one in a sample of a deeper stack
+#define PROFILE_MAX_DEPTH 256
+
+// ticks of the profiling timer not sampled yet, the SIGPROF handler only
+// counts them, run() samples the call stack at its next safepoint where the
+// frames are stored and no collection is running
+extern volatile sig_atomic_t pendingSamples;
+
+// the tick may land on a gc thread, so the count is only touched atomically
+static inline bool isSamplePending() {
+  return __atomic_load_n(&pendingSamples, __ATOMIC_RELAXED) > 0;
+}
+
+// opens the output file, so a bad path fails before the script runs, and
+// arms a SIGPROF timer firing rate times per second of cpu time
+void startProfiler(const char *path, int rate);
+// resolves the frames of the vm to function names and lines and counts the
+// stack once per pending tick
+void takeSample();
+// stops the timer, ticks that never reached a safepoint are charged to the
+// vm itself
+void stopProfiler();
+// the samples as folded stacks, one line per stack with its frames from the
+// outermost one joined by ';' and the number of samples after a space
+void writeProfile();
+
+#endif
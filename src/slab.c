@@ -0,0 +1,496 @@
+// mremap() is a linux extension
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include "slab.h"
+
+#ifdef SLAB_ALLOCATOR
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// cell sizes step by 16 bytes up to 128 and by a quarter of the size above,
+// so no class up to 512 wastes more than 20% of a cell, the ones above are
+// the biggest cells that fit 6, 5, 4, 3 and 2 to a 4 KB page after the header
+static const size_t classSizes[] = {16,  32,  48,  64,  80,  96,  112,
+                                    128, 160, 192, 224, 256, 320, 384,
+                                    448, 512, 656, 800, 992, 1328, 2000};
+#define CLASS_COUNT ((int)(sizeof(classSizes) / sizeof(classSizes[0])))
+
+#define SLAB_HEADER_SIZE ((sizeof(Slab) + 15) & ~(size_t)15)
+
+uintptr_t slabMask = 0;
+static size_t pageSize = 0;
+static size_t markBytes;
+static Slab *available[CLASS_COUNT];
+// slabs holding at least one cell
+static int slabsInUse = 0;
+
+// spans of up to this many pages are cached by their size once freed, bigger
+// ones are unmapped
+#define SPAN_CACHE_PAGES 8
+
+// freed runs of pages of one size, linked through next
+typedef struct {
+  Slab *top;
+  int count;
+  // the fewest cached since the last trim, the cache is a stack so that many
+  // at its bottom sat unused through the whole cycle
+  int idleCount;
+} PageCache;
+
+// the first one holds the empty slabs of any class and the one page spans
+static PageCache pageCaches[SPAN_CACHE_PAGES];
+#ifdef PARALLEL_GC
+// slabs touched by sweep workers, pushed concurrently and taken by one thread
+static Slab *queuedSlabs = NULL;
+#endif
+#ifdef COMPACTING_GC
+// a slab is evacuated when less than this percentage of its cells is live
+#define EVACUATE_OCCUPANCY 50
+
+static Slab *evacuatingSlabs = NULL;
+#endif
+
+static int sizeClass(size_t size) {
+  if (size <= 128) {
+    return (int)((size - 1) / 16);
+  }
+  if (size <= 256) {
+    return 8 + (int)((size - 129) / 32);
+  }
+  if (size <= 512) {
+    return 12 + (int)((size - 257) / 64);
+  }
+  int class = 16;
+  while (classSizes[class] < size) {
+    class++;
+  }
+  return class;
+}
+
+static size_t roundToPages(size_t size) {
+  if (pageSize == 0) {
+    pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    slabMask = ~(uintptr_t)(pageSize - 1);
+    markBytes = pageSize / 16 / 8;
+  }
+  return (size + pageSize - 1) & ~(pageSize - 1);
+}
+
+static void *mapPages(size_t size) {
+  void *pages =
+      mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1,
+           0);
+  if (pages == MAP_FAILED) {
+    exit(1);
+  }
+  return pages;
+}
+
+// pages with a zeroed mark bitmap of their own
+static Slab *mapSlab(size_t size) {
+  Slab *slab = (Slab *)mapPages(size);
+  slab->marks = (uint64_t *)calloc(1, markBytes);
+  if (slab->marks == NULL) {
+    exit(1);
+  }
+  return slab;
+}
+
+static void unmapSlab(Slab *slab, size_t size) {
+  free(slab->marks);
+  munmap(slab, size);
+}
+
+static void linkAvailable(Slab *slab) {
+  slab->prev = NULL;
+  slab->next = available[slab->sizeClass];
+  if (slab->next != NULL) {
+    slab->next->prev = slab;
+  }
+  available[slab->sizeClass] = slab;
+  slab->isAvailable = true;
+}
+
+static void unlinkAvailable(Slab *slab) {
+  if (slab->prev != NULL) {
+    slab->prev->next = slab->next;
+  } else {
+    available[slab->sizeClass] = slab->next;
+  }
+  if (slab->next != NULL) {
+    slab->next->prev = slab->prev;
+  }
+  slab->isAvailable = false;
+}
+
+// pages for a slab or a span, from the cache when it has some of that size
+static Slab *takePages(int pages) {
+  PageCache *cache = &pageCaches[pages - 1];
+  Slab *slab = cache->top;
+  if (slab == NULL) {
+    return mapSlab(pages * roundToPages(1));
+  }
+  cache->top = slab->next;
+  if (--cache->count < cache->idleCount) {
+    cache->idleCount = cache->count;
+  }
+  // cells of another class may have left bits where ours start
+  memset(slab->marks, 0, markBytes);
+  return slab;
+}
+
+static void cachePages(Slab *slab, int pages) {
+  PageCache *cache = &pageCaches[pages - 1];
+  slab->next = cache->top;
+  cache->top = slab;
+  cache->count++;
+}
+
+static Slab *newSlab(int class) {
+  Slab *slab = takePages(1);
+  slab->freeCells = NULL;
+  slab->bump = (char *)slab + SLAB_HEADER_SIZE;
+  slab->liveCount = 0;
+  slab->capacity = (int)((pageSize - SLAB_HEADER_SIZE) / classSizes[class]);
+  slab->sizeClass = class;
+  slab->isQueued = false;
+  slab->isEvacuating = false;
+  slab->nextQueued = NULL;
+  linkAvailable(slab);
+  slabsInUse++;
+  return slab;
+}
+
+// an empty slab is cached for any class, trimSlabs() decides what goes back
+// to the os
+static void releaseSlab(Slab *slab) {
+  if (slab->isAvailable) {
+    unlinkAvailable(slab);
+  }
+  cachePages(slab, 1);
+  slabsInUse--;
+}
+
+static void *allocateCell(size_t size) {
+  int class = sizeClass(size);
+  Slab *slab = available[class];
+  if (slab == NULL) {
+    slab = newSlab(class);
+  }
+  void *cell = slab->freeCells;
+  if (cell != NULL) {
+    slab->freeCells = *(void **)cell;
+  } else {
+    cell = slab->bump;
+    slab->bump += classSizes[class];
+  }
+  if (++slab->liveCount == slab->capacity) {
+    unlinkAvailable(slab);
+  }
+  return cell;
+}
+
+static void freeCell(void *cell) {
+  Slab *slab = slabOf(cell);
+  *(void **)cell = slab->freeCells;
+  slab->freeCells = cell;
+  if (slab->liveCount-- == slab->capacity) {
+    linkAvailable(slab);
+  }
+  if (slab->liveCount == 0) {
+    releaseSlab(slab);
+  }
+}
+
+static void *allocate(size_t size) {
+  if (size <= SLAB_MAX_SIZE) {
+    return allocateCell(size);
+  }
+  if (size >= LARGE_OBJECT_SIZE) {
+    return mapPages(roundToPages(size));
+  }
+  void *result = malloc(size);
+  if (result == NULL) {
+    exit(1);
+  }
+  return result;
+}
+
+static void release(void *pointer, size_t size) {
+  if (size <= SLAB_MAX_SIZE) {
+    freeCell(pointer);
+  } else if (size >= LARGE_OBJECT_SIZE) {
+    munmap(pointer, roundToPages(size));
+  } else {
+    free(pointer);
+  }
+}
+
+void *slabReallocate(void *pointer, size_t oldSize, size_t newSize) {
+  if (newSize == 0) {
+    if (pointer != NULL) {
+      release(pointer, oldSize);
+    }
+    return NULL;
+  }
+  if (pointer == NULL) {
+    return allocate(newSize);
+  }
+
+  if (oldSize <= SLAB_MAX_SIZE && newSize <= SLAB_MAX_SIZE &&
+      sizeClass(oldSize) == sizeClass(newSize)) {
+    return pointer;
+  }
+  if (oldSize > SLAB_MAX_SIZE && oldSize < LARGE_OBJECT_SIZE &&
+      newSize > SLAB_MAX_SIZE && newSize < LARGE_OBJECT_SIZE) {
+    void *result = realloc(pointer, newSize);
+    if (result == NULL) {
+      exit(1);
+    }
+    return result;
+  }
+  if (oldSize >= LARGE_OBJECT_SIZE && newSize >= LARGE_OBJECT_SIZE) {
+    size_t oldPages = roundToPages(oldSize);
+    size_t newPages = roundToPages(newSize);
+    if (oldPages == newPages) {
+      return pointer;
+    }
+#ifdef MREMAP_MAYMOVE
+    // the kernel moves the pages instead of copying them
+    void *result = mremap(pointer, oldPages, newPages, MREMAP_MAYMOVE);
+    if (result == MAP_FAILED) {
+      exit(1);
+    }
+    return result;
+#endif
+  }
+
+  void *result = allocate(newSize);
+  memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+  release(pointer, oldSize);
+  return result;
+}
+
+// a size that would wrap once the header and the rounding are added can't
+// be mapped anyway, it takes the out of memory exit
+static size_t spanSize(size_t size) {
+  roundToPages(1);
+  if (size > SIZE_MAX - SLAB_HEADER_SIZE - pageSize) {
+    exit(1);
+  }
+  return roundToPages(SLAB_HEADER_SIZE + size);
+}
+
+// pages of the span for an object of size
+static size_t spanPages(size_t size) { return spanSize(size) / pageSize; }
+
+// spans too big to be cached are mapped and unmapped one by one
+static bool isCachedSpan(size_t pages) {
+  return pages >= 1 && pages <= SPAN_CACHE_PAGES;
+}
+
+void *slabAllocateObject(size_t size) {
+  if (size <= SLAB_MAX_SIZE) {
+    return allocateCell(size);
+  }
+  size_t pages = spanPages(size);
+  bool isCached = isCachedSpan(pages);
+  Slab *span = isCached ? takePages((int)pages) : mapSlab(spanSize(size));
+  span->freeCells = NULL;
+  span->bump = NULL;
+  span->liveCount = 1;
+  span->capacity = 1;
+  span->sizeClass = -1;
+  span->pageCount = isCached ? (int)pages : 0;
+  span->isAvailable = false;
+  span->isQueued = false;
+  span->isEvacuating = false;
+  return (char *)span + SLAB_HEADER_SIZE;
+}
+
+void slabFreeObject(void *object, size_t size) {
+  if (size <= SLAB_MAX_SIZE) {
+    freeCell(object);
+  } else if (isCachedSpan(spanPages(size))) {
+    cachePages(slabOf(object), (int)spanPages(size));
+  } else {
+    unmapSlab(slabOf(object), spanSize(size));
+  }
+}
+
+#ifdef PARALLEL_GC
+// the slab is relinked or cached by finishSharedFrees()
+static void queueShared(Slab *slab) {
+  Slab *queued = __atomic_load_n(&queuedSlabs, __ATOMIC_RELAXED);
+  do {
+    slab->nextQueued = queued;
+  } while (!__atomic_compare_exchange_n(&queuedSlabs, &queued, slab, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void slabFreeShared(void *pointer, size_t size) {
+  if (size > SLAB_MAX_SIZE) {
+    // malloc and munmap can be called from any thread
+    release(pointer, size);
+    return;
+  }
+  // only pushes happen while the workers run, so the list can't see ABA
+  Slab *slab = slabOf(pointer);
+  void *head = __atomic_load_n(&slab->freeCells, __ATOMIC_RELAXED);
+  do {
+    *(void **)pointer = head;
+  } while (!__atomic_compare_exchange_n(&slab->freeCells, &head, pointer, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  int live = __atomic_sub_fetch(&slab->liveCount, 1, __ATOMIC_RELAXED);
+  // a slab that stops being full or becomes empty has to be relinked, the
+  // first worker to see that queues it
+  if ((live + 1 == slab->capacity || live == 0) &&
+      !__atomic_exchange_n(&slab->isQueued, true, __ATOMIC_RELAXED)) {
+    queueShared(slab);
+  }
+}
+
+void slabFreeSharedObject(void *object, size_t size) {
+  if (size <= SLAB_MAX_SIZE) {
+    slabFreeShared(object, size);
+  } else if (isCachedSpan(spanPages(size))) {
+    // the caches belong to the collecting thread
+    Slab *span = slabOf(object);
+    span->liveCount = 0;
+    queueShared(span);
+  } else {
+    // spans belong to one object, nothing else touches them
+    unmapSlab(slabOf(object), spanSize(size));
+  }
+}
+
+void finishSharedFrees() {
+  Slab *slab = queuedSlabs;
+  queuedSlabs = NULL;
+  while (slab != NULL) {
+    Slab *next = slab->nextQueued;
+    slab->isQueued = false;
+    if (slab->sizeClass < 0) {
+      cachePages(slab, slab->pageCount);
+    } else if (slab->liveCount == 0) {
+      releaseSlab(slab);
+    } else if (!slab->isAvailable) {
+      linkAvailable(slab);
+    }
+    slab = next;
+  }
+}
+#endif
+
+// unmaps the pages at the bottom of cache beyond the keep that sat idle
+// since the last trim
+static void trimCache(PageCache *cache, int pages, int keep) {
+  int excess = cache->idleCount - keep;
+  if (excess > 0) {
+    Slab **link = &cache->top;
+    for (int i = cache->count - excess; i > 0; i--) {
+      link = &(*link)->next;
+    }
+    Slab *slab = *link;
+    *link = NULL;
+    while (slab != NULL) {
+      Slab *next = slab->next;
+      unmapSlab(slab, pages * pageSize);
+      slab = next;
+    }
+    cache->count -= excess;
+  }
+  cache->idleCount = cache->count;
+}
+
+void trimSlabs() {
+  // spans keep no more pages than the slabs do
+  for (int pages = 1; pages <= SPAN_CACHE_PAGES; pages++) {
+    trimCache(&pageCaches[pages - 1], pages, SLAB_CACHE_MAX / pages);
+  }
+}
+
+#ifdef COMPACTING_GC
+void slabUsage(size_t *mapped, size_t *unused) {
+  roundToPages(1);
+  *mapped = (size_t)slabsInUse * pageSize;
+  *unused = 0;
+  for (int class = 0; class < CLASS_COUNT; class++) {
+    for (Slab *slab = available[class]; slab != NULL; slab = slab->next) {
+      *unused += (size_t)(slab->capacity - slab->liveCount) * classSizes[class];
+    }
+  }
+}
+
+static bool isSparse(Slab *slab) {
+  return slab->liveCount * 100 < slab->capacity * EVACUATE_OCCUPANCY;
+}
+
+bool startSlabEvacuation(bool everything) {
+  for (int class = 0; class < CLASS_COUNT; class++) {
+    // sparse slabs pour their cells into the free cells of the dense ones
+    // first, the rest need new slabs
+    int sparseCount = 0;
+    int moving = 0;
+    int room = 0;
+    int capacity = 0;
+    for (Slab *slab = available[class]; slab != NULL; slab = slab->next) {
+      capacity = slab->capacity;
+      if (isSparse(slab)) {
+        sparseCount++;
+        moving += slab->liveCount;
+      } else {
+        room += slab->capacity - slab->liveCount;
+      }
+    }
+    int needed = moving > room ? (moving - room + capacity - 1) / capacity : 0;
+    if (!everything && sparseCount <= needed) {
+      continue;
+    }
+
+    Slab *slab = available[class];
+    while (slab != NULL) {
+      Slab *next = slab->next;
+      if (everything || isSparse(slab)) {
+        unlinkAvailable(slab);
+        slab->isEvacuating = true;
+        slab->nextQueued = evacuatingSlabs;
+        evacuatingSlabs = slab;
+      }
+      slab = next;
+    }
+  }
+  return evacuatingSlabs != NULL;
+}
+
+void finishSlabEvacuation() {
+  Slab *slab = evacuatingSlabs;
+  evacuatingSlabs = NULL;
+  while (slab != NULL) {
+    Slab *next = slab->nextQueued;
+    slab->isEvacuating = false;
+    slab->nextQueued = NULL;
+    if (slab->liveCount > 0) {
+      linkAvailable(slab);
+    }
+    slab = next;
+  }
+}
+#endif
+
+void freeSlabs() {
+  for (int pages = 1; pages <= SPAN_CACHE_PAGES; pages++) {
+    PageCache *cache = &pageCaches[pages - 1];
+    while (cache->top != NULL) {
+      Slab *next = cache->top->next;
+      unmapSlab(cache->top, pages * pageSize);
+      cache->top = next;
+    }
+    cache->count = 0;
+    cache->idleCount = 0;
+  }
+}
+#endif
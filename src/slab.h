@@ -0,0 +1,104 @@
+#ifndef clox_slab_h
+#define clox_slab_h
+
+#include "common.h"
+
+#ifdef SLAB_ALLOCATOR
+// requests up to this size are cells of a page sized slab, slabs are kept per
+// size class and each has its own free list
+#define SLAB_MAX_SIZE 2000
+// requests from this size on get pages of their own straight from mmap, the
+// ones in between go to malloc
+#define LARGE_OBJECT_SIZE (32 * 1024)
+// empty slabs kept mapped even when they are idle
+#define SLAB_CACHE_MAX 64
+
+// a slab is one page, it starts with this header so the slab of a cell is
+// found by rounding the address down, an object too big for a cell gets a
+// span of pages of its own with the same header in front, small spans are
+// cached once freed like the empty slabs
+typedef struct Slab {
+  // freed cells, linked through their first word
+  void *freeCells;
+  // cells past bump were never handed out
+  char *bump;
+  int liveCount;
+  int capacity;
+  // -1 for a span
+  int sizeClass;
+  // pages of a cached span, 0 for one mapped on its own
+  int pageCount;
+  // neighbours in the list of slabs of the class that have a free cell
+  struct Slab *prev;
+  struct Slab *next;
+  bool isAvailable;
+  // set while the slab waits for finishSharedFrees()
+  bool isQueued;
+  // set while a compaction moves the objects out of the slab
+  bool isEvacuating;
+  // the slabs waiting for finishSharedFrees() or being evacuated
+  struct Slab *nextQueued;
+  // one mark bit per 16 bytes of the first page, allocated away from the
+  // slab so marking never writes to the pages objects live in
+  uint64_t *marks;
+} Slab;
+
+extern uintptr_t slabMask;
+
+static inline Slab *slabOf(const void *pointer) {
+  return (Slab *)((uintptr_t)pointer & slabMask);
+}
+
+// the word of the mark bitmap holding the bit of the object at pointer
+static inline uint64_t *markWordOf(const void *pointer, uint64_t *bit) {
+  uintptr_t index = ((uintptr_t)pointer & ~slabMask) >> 4;
+  *bit = (uint64_t)1 << (index & 63);
+  return &slabOf(pointer)->marks[index >> 6];
+}
+
+// the back end of reallocate(), there is no header in front of an allocation
+// so oldSize must be the exact size it was made with
+void *slabReallocate(void *pointer, size_t oldSize, size_t newSize);
+
+// objects always come from slabs, so each of them has a mark bit, which has
+// to be clear by the time the object is freed
+void *slabAllocateObject(size_t size);
+void slabFreeObject(void *object, size_t size);
+
+#ifdef PARALLEL_GC
+// frees from sweep worker threads while the mutator waits, slabs whose state
+// changed are relinked by finishSharedFrees() on the collecting thread once
+// the workers are done
+void slabFreeShared(void *pointer, size_t size);
+void slabFreeSharedObject(void *object, size_t size);
+void finishSharedFrees();
+#endif
+
+// called after every collection, unmaps the empty slabs that were not needed
+// since the previous one, so pages go back to the os once the heap shrinks
+// and stay mapped while it only cycles
+void trimSlabs();
+// unmaps every cached slab once the vm has freed everything
+void freeSlabs();
+
+#ifdef COMPACTING_GC
+// bytes in slabs that hold at least one cell, and how many of those bytes are
+// free cells in slabs that are not full
+void slabUsage(size_t *mapped, size_t *unused);
+// takes the slabs filled to less than half out of allocation, in the classes
+// where moving their cells into the other slabs frees more slabs than it
+// fills, or every slab with a free cell when everything is set, false when
+// no slab was picked
+bool startSlabEvacuation(bool everything);
+
+static inline bool isSlabEvacuating(const void *pointer) {
+  return slabOf(pointer)->isEvacuating;
+}
+
+// the evacuated slabs are empty and cached by now unless something other
+// than an object still lives in them, those go back to allocation
+void finishSlabEvacuation();
+#endif
+#endif
+
+#endif
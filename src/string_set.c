@@ -0,0 +1,153 @@
+#include "string_set.h"
+#include "memory.h"
+#include "object.h"
+#include <stdint.h>
+#include <string.h>
+
+#define SET_MIN_CAPACITY 8
+
+// linear probing without tombstones, a removed entry is filled by shifting
+// back the entries that probed past it, so probe chains never get longer than
+// the live entries make them
+
+static void resizeStringSet(StringSet *set, int newCap) {
+  StringSetEntry *entries = ALLOCATE(StringSetEntry, newCap);
+  for (int i = 0; i < newCap; i++) {
+    entries[i].key = NULL;
+    entries[i].hash = 0;
+  }
+
+  for (int i = 0; i < set->capacity; i++) {
+    StringSetEntry *entry = &set->entries[i];
+    if (entry->key == NULL) {
+      continue;
+    }
+    int idx = entry->hash & (newCap - 1);
+    while (entries[idx].key != NULL) {
+      idx = (idx + 1) & (newCap - 1);
+    }
+    entries[idx] = *entry;
+  }
+
+  FREE_ARRAY(StringSetEntry, set->entries, set->capacity);
+  set->entries = entries;
+  set->capacity = newCap;
+}
+
+void initStringSet(StringSet *set) {
+  set->count = 0;
+  set->capacity = 0;
+  set->added = 0;
+  set->entries = NULL;
+}
+
+void freeStringSet(StringSet *set) {
+  FREE_ARRAY(StringSetEntry, set->entries, set->capacity);
+  initStringSet(set);
+}
+
+ObjString *findInternedString(StringSet *set, const char *chars, int length,
+                              uint32_t hash) {
+  if (set->count == 0) {
+    return NULL;
+  }
+  int mask = set->capacity - 1;
+  for (int idx = hash & mask;; idx = (idx + 1) & mask) {
+    StringSetEntry *entry = &set->entries[idx];
+    if (entry->key == NULL) {
+      return NULL;
+    }
+    if (entry->hash == hash && entry->key->length == length &&
+        memcmp(entry->key->chars, chars, length) == 0) {
+      return entry->key;
+    }
+  }
+}
+
+void addInternedString(StringSet *set, ObjString *string) {
+  if (set->count + 1 > set->capacity * 3 / 4) {
+    resizeStringSet(set, set->capacity < SET_MIN_CAPACITY
+                             ? SET_MIN_CAPACITY
+                             : set->capacity * 2);
+  }
+  int mask = set->capacity - 1;
+  int idx = string->hash & mask;
+  while (set->entries[idx].key != NULL) {
+    idx = (idx + 1) & mask;
+  }
+  set->entries[idx].key = string;
+  set->entries[idx].hash = string->hash;
+  set->count++;
+  set->added++;
+}
+
+static void removeEntry(StringSet *set, int hole) {
+  int mask = set->capacity - 1;
+  for (int idx = (hole + 1) & mask; set->entries[idx].key != NULL;
+       idx = (idx + 1) & mask) {
+    // the entry may fill the hole only if its home slot is not between the
+    // hole and where it sits now, otherwise lookups would no longer reach it
+    int home = set->entries[idx].hash & mask;
+    if (((idx - home) & mask) >= ((idx - hole) & mask)) {
+      set->entries[hole] = set->entries[idx];
+      hole = idx;
+    }
+  }
+  set->entries[hole].key = NULL;
+  set->entries[hole].hash = 0;
+  set->count--;
+}
+
+#ifdef GENERATIONAL_GC
+static int findEntryOf(StringSet *set, ObjString *string) {
+  int mask = set->capacity - 1;
+  int idx = string->hash & mask;
+  while (set->entries[idx].key != string) {
+    idx = (idx + 1) & mask;
+  }
+  return idx;
+}
+
+void replaceInternedString(StringSet *set, ObjString *from, ObjString *to) {
+  set->entries[findEntryOf(set, from)].key = to;
+}
+
+void removeInternedString(StringSet *set, ObjString *string) {
+  removeEntry(set, findEntryOf(set, string));
+}
+#endif
+
+void removeWhiteStrings(StringSet *set) {
+  for (int i = 0; i < set->capacity; i++) {
+    // entries shifted back into slot i are checked before moving on, entries
+    // that wrap around from the front were already checked and survived
+    while (set->entries[i].key != NULL &&
+           !isObjMarked(&set->entries[i].key->obj)) {
+      removeEntry(set, i);
+    }
+  }
+
+  // after a burst of temporary strings most of the set is empty, the memory
+  // is given back once the load drops under 1/8, but only down to what the
+  // last cycle needed, a program that keeps making strings would otherwise
+  // regrow the set after every collection
+  int expected = set->count + set->added;
+  set->added = 0;
+  if (set->capacity > SET_MIN_CAPACITY && set->count < set->capacity / 8) {
+    int newCap = SET_MIN_CAPACITY;
+    while (expected > newCap * 3 / 4) {
+      newCap *= 2;
+    }
+    if (newCap < set->capacity) {
+      resizeStringSet(set, newCap);
+    }
+  }
+}
+
+#ifdef COMPACTING_GC
+void forwardInternedStrings(StringSet *set) {
+  for (int i = 0; i < set->capacity; i++) {
+    set->entries[i].key = (ObjString *)forwardObj((Obj *)set->entries[i].key);
+  }
+}
+#endif
@@ -0,0 +1,49 @@
+#ifndef clox_string_set_h
+#define clox_string_set_h
+
+#include "common.h"
+#include "value.h"
+
+// the intern pool, holds every interned string without keeping it alive,
+// strings the gc finds unreachable are dropped from it before the sweep
+typedef struct {
+  ObjString *key;
+  // copy of key->hash, probes and rehashes never touch the string itself
+  uint32_t hash;
+} StringSetEntry;
+
+typedef struct {
+  int count;
+  int capacity;
+  // strings added since the last collection, predicts how many the next gc
+  // cycle will add
+  int added;
+  StringSetEntry *entries;
+} StringSet;
+
+void initStringSet(StringSet *set);
+
+void freeStringSet(StringSet *set);
+
+ObjString *findInternedString(StringSet *set, const char *chars, int length,
+                              uint32_t hash);
+
+// the string must not be in the set yet
+void addInternedString(StringSet *set, ObjString *string);
+
+#ifdef GENERATIONAL_GC
+// a minor collection moved the string to a new address or found it dead
+void replaceInternedString(StringSet *set, ObjString *from, ObjString *to);
+void removeInternedString(StringSet *set, ObjString *string);
+#endif
+
+// drops every string left unmarked by the gc and shrinks the set when most of
+// it is gone
+void removeWhiteStrings(StringSet *set);
+
+#ifdef COMPACTING_GC
+// follows the strings a compaction moved, the hashes stay the same
+void forwardInternedStrings(StringSet *set);
+#endif
+
+#endif
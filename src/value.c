@@ -29,6 +29,17 @@ void writeValueArray(ValueArray *array, Value value) {
 }
 
 void printValue(Value value) {
+#ifdef NAN_BOXING
+  if (IS_BOOL(value)) {
+    printf(AS_BOOL(value) ? "true" : "false");
+  } else if (IS_NIL(value)) {
+    printf("nil");
+  } else if (IS_NUMBER(value)) {
+    printf("%g", AS_NUMBER(value));
+  } else if (IS_OBJ(value)) {
+    printValueObject(value);
+  }
+#else
   switch (value.type) {
   case VAL_NUMBER:
     printf("%g", AS_NUMBER(value));
@@ -42,24 +53,47 @@ void printValue(Value value) {
   case VAL_OBJ:
     printValueObject(value);
     break;
+  case VAL_UNDEFINED:
+    printf("undefined");
+    break;
   }
+#endif
 }
 
 bool valuesEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+  // compare numbers as doubles so that NaN != NaN and 0 == -0 still hold,
+  // every other value is equal only to its own bit pattern
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    return AS_NUMBER(a) == AS_NUMBER(b);
+  }
+  if (a == b) {
+    return true;
+  }
+  if (IS_STRING(a) && IS_STRING(b)) {
+    return stringsEqual(AS_STRING(a), AS_STRING(b));
+  }
+  return false;
+#else
   if (a.type != b.type)
     return false;
   switch (a.type) {
   case VAL_BOOL:
     return AS_BOOL(a) == AS_BOOL(b);
   case VAL_NIL:
+  case VAL_UNDEFINED:
     return true;
   case VAL_NUMBER:
     return AS_NUMBER(a) == AS_NUMBER(b);
   case VAL_OBJ: {
+    if (IS_STRING(a) && IS_STRING(b)) {
+      return stringsEqual(AS_STRING(a), AS_STRING(b));
+    }
     return AS_OBJ(a) == AS_OBJ(b);
   }
 
   default:
     return false; // Unreachable.
   }
+#endif
 }
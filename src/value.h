@@ -2,15 +2,69 @@
 #define clox_value_h
 
 #include "common.h"
+#include <string.h>
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
 
+#ifdef NAN_BOXING
+
+// every double that is not a quiet NaN is stored as is, everything else is
+// packed into the unused quiet NaN payload: singletons get a small tag in
+// the low bits, object pointers set the sign bit and keep their 48-bit address
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL 1   // 01.
+#define TAG_FALSE 2 // 10.
+#define TAG_TRUE 3  // 11.
+#define TAG_UNDEFINED 4 // 100.
+
+typedef uint64_t Value;
+
+#define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
+
+#define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_NUMBER(value) valueToNum(value)
+#define AS_OBJ(value) ((Obj *)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define BOOL_VAL(b) ((b) ? TRUE_VAL : FALSE_VAL)
+#define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define NUMBER_VAL(num) numToValue(num)
+#define OBJ_VAL(obj) (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
+
+// true and false differ only in the lowest bit, or-ing it in maps both to
+// TRUE_VAL and nothing else
+#define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value) ((value) == NIL_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+static inline double valueToNum(Value value) {
+  double num;
+  memcpy(&num, &value, sizeof(Value));
+  return num;
+}
+
+static inline Value numToValue(double num) {
+  Value value;
+  memcpy(&value, &num, sizeof(double));
+  return value;
+}
+
+#else
+
 typedef enum {
   VAL_BOOL,
   VAL_NIL,
   VAL_NUMBER,
   VAL_OBJ,
+  // marks a global slot that was resolved but never defined, it never
+  // reaches Lox code
+  VAL_UNDEFINED,
 } ValueType;
 
 typedef struct {
@@ -28,14 +82,18 @@ typedef struct {
 
 #define BOOL_VAL(value) ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
+#define UNDEFINED_VAL ((Value){VAL_UNDEFINED, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj *)object}})
 
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NIL(value) ((value).type == VAL_NIL)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
 
+#endif
+
 typedef struct {
   int capacity;
   int count;
@@ -46,6 +104,7 @@ void initValueArray(ValueArray *array);
 void freeValueArray(ValueArray *array);
 void writeValueArray(ValueArray *array, Value value);
 void printValue(Value value);
+// strings may get flattened, so a and b must be reachable from the vm stack
 bool valuesEqual(Value a, Value b);
 
 #endif
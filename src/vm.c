@@ -4,21 +4,67 @@
 #include "debug.h"
 #include "hash_table.h"
 #include "memory.h"
+#include "metrics.h"
 #include "object.h"
+#include "profiler.h"
 #include "value.h"
+#include <limits.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#ifdef PARALLEL_GC
+#include <unistd.h>
+#endif
+
 VM vm;
 
 static Value clockNative(int argCount, Value *args) {
   return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
+// returns the number of bytes freed
+static Value gcCollectNative(int argCount, Value *args) {
+  size_t before = heapSize();
+  collectGarbage();
+  size_t after = heapSize();
+  return NUMBER_VAL(before > after ? (double)(before - after) : 0);
+}
+
+static Value gcDisableNative(int argCount, Value *args) {
+  vm.gcEnabled = false;
+  return NIL_VAL;
+}
+
+static Value gcEnableNative(int argCount, Value *args) {
+  vm.gcEnabled = true;
+  return NIL_VAL;
+}
+
+// bytes in live objects and the garbage not collected yet
+static Value heapSizeNative(int argCount, Value *args) {
+  return NUMBER_VAL((double)heapSize());
+}
+
+// the metrics written by --stats, as a JSON string
+static Value vmStatsNative(int argCount, Value *args) {
+  char *json = NULL;
+  size_t length = 0;
+  FILE *stream = open_memstream(&json, &length);
+  if (stream == NULL) {
+    exit(1);
+  }
+  writeMetrics(stream);
+  fclose(stream);
+  Value result = OBJ_VAL(copyRuntimeString(json, (int)length));
+  free(json);
+  return result;
+}
+
 static void resetStack() {
   vm.stackTop = vm.stack;
   vm.frameCount = 0;
@@ -50,11 +96,28 @@ static void runtimeError(const char *format, ...) {
 static void defineNative(const char *name, NativeFn function) {
   push(OBJ_VAL(copyString(name, (int)strlen(name))));
   push(OBJ_VAL(newNative(function)));
-  setTableValue(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+  int slot = resolveGlobal(AS_STRING(vm.stack[0]));
+  vm.globalValues.values[slot] = vm.stack[1];
   pop();
   pop();
 }
 
+int resolveGlobal(ObjString *name) {
+  name = internString(name);
+  Value slot;
+  if (getTableValue(&vm.globalSlots, name, &slot)) {
+    return (int)AS_NUMBER(slot);
+  }
+
+  push(OBJ_VAL(name));
+  int newSlot = vm.globalValues.count;
+  writeValueArray(&vm.globalNames, OBJ_VAL(name));
+  writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+  setTableValue(&vm.globalSlots, name, NUMBER_VAL((double)newSlot));
+  pop();
+  return newSlot;
+}
+
 void push(Value value) {
   *vm.stackTop = value;
   vm.stackTop++;
@@ -67,22 +130,76 @@ Value pop() {
 
 static Value peek(int distance) { return vm.stackTop[-1 - distance]; }
 
-static bool call(ObjClosure *closure, int argCount) {
+static void growFrames() {
+  int oldCap = vm.frameCapacity;
+  vm.frameCapacity = GROW_CAPACITY(oldCap);
+  if (vm.frameCapacity > vm.maxFrames) {
+    vm.frameCapacity = vm.maxFrames;
+  }
+  vm.frames = GROW_ARRAY(CallFrame, vm.frames, oldCap, vm.frameCapacity);
+}
+
+static void growStack(int needed) {
+  int newCap = vm.stackCapacity;
+  while (newCap < needed) {
+    newCap = GROW_CAPACITY(newCap);
+  }
+
+  // the old block is kept until every pointer into it has been rebased
+  Value *oldStack = vm.stack;
+  Value *newStack = ALLOCATE(Value, newCap);
+  memcpy(newStack, oldStack, sizeof(Value) * (vm.stackTop - oldStack));
+
+  for (int i = 0; i < vm.frameCount; i++) {
+    vm.frames[i].slots = newStack + (vm.frames[i].slots - oldStack);
+  }
+  for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL;
+       upvalue = upvalue->next) {
+    upvalue->location = newStack + (upvalue->location - oldStack);
+  }
+  vm.stackTop = newStack + (vm.stackTop - oldStack);
+  vm.stack = newStack;
+
+  FREE_ARRAY(Value, oldStack, vm.stackCapacity);
+  vm.stackCapacity = newCap;
+}
+
+static bool checkArity(ObjClosure *closure, int argCount) {
   if (argCount != closure->function->arity) {
     runtimeError("Expected %d arguments but got %d.", closure->function->arity,
                  argCount);
     return false;
   }
+  return true;
+}
+
+// makes room for everything function pushes in a frame starting at slots
+static void reserveStack(Value *slots, ObjFunction *function) {
+  int needed = (int)(slots - vm.stack) + function->maxStack;
+  if (needed > vm.stackCapacity) {
+    growStack(needed);
+  }
+}
 
-  if (vm.frameCount == FRAMES_MAX) {
-    runtimeError("Stack overflow.");
+static bool call(ObjClosure *closure, int argCount) {
+  if (!checkArity(closure, argCount)) {
     return false;
   }
 
+  if (vm.frameCount == vm.frameCapacity) {
+    if (vm.frameCount >= vm.maxFrames) {
+      runtimeError("Stack overflow.");
+      return false;
+    }
+    growFrames();
+  }
+  reserveStack(vm.stackTop - argCount - 1, closure->function);
+
   CallFrame *frame = &vm.frames[vm.frameCount++];
   frame->closure = closure;
   frame->ip = closure->function->chunk.code;
   frame->slots = vm.stackTop - argCount - 1;
+  vm.metrics.calls++;
   return true;
 }
 
@@ -93,6 +210,8 @@ static bool callValue(Value callee, int argCount) {
       return call(AS_CLOSURE(callee), argCount);
     case OBJ_NATIVE: {
       NativeFn native = AS_NATIVE(callee);
+      vm.metrics.calls++;
+      vm.metrics.nativeCalls++;
       Value result = native(argCount, vm.stackTop - argCount);
       vm.stackTop -= argCount + 1;
       push(result);
@@ -131,350 +250,791 @@ static ObjUpvalue *captureUpvalue(Value *local) {
 static void closeUpvalues(Value *last) {
   while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
     ObjUpvalue *upvalue = vm.openUpvalues;
+    WRITE_BARRIER(&upvalue->obj, *upvalue->location);
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
     vm.openUpvalues = upvalue->next;
   }
 }
 
+// reuses the frame of the running function for the callee, its stack window
+// is replaced with the callee and the arguments
+static bool tailCall(ObjClosure *closure, int argCount) {
+  if (!checkArity(closure, argCount)) {
+    return false;
+  }
+
+  CallFrame *frame = &vm.frames[vm.frameCount - 1];
+  closeUpvalues(frame->slots);
+  Value *callee = vm.stackTop - argCount - 1;
+  memmove(frame->slots, callee, sizeof(Value) * (argCount + 1));
+  vm.stackTop = frame->slots + argCount + 1;
+  frame->closure = closure;
+  frame->ip = closure->function->chunk.code;
+  reserveStack(frame->slots, closure->function);
+  vm.metrics.calls++;
+  return true;
+}
+
 static bool isFalsey(Value value) {
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate() {
+// false when the result would not fit in a string length, ropes get there
+// after a few dozen doublings without using much memory
+static bool concatenate() {
   ObjString *rhs = AS_STRING(peek(0));
   ObjString *lhs = AS_STRING(peek(1));
-  int newLen = lhs->length + rhs->length;
-  char *newString = ALLOCATE(char, newLen + 1);
-  memcpy(newString, lhs->chars, lhs->length);
-  memcpy(newString + lhs->length, rhs->chars, rhs->length);
-  newString[newLen] = '\0';
-  ObjString *obj = takeString(newString, newLen);
+  if (lhs->length > INT_MAX - rhs->length) {
+    return false;
+  }
+  ObjString *obj = concatStrings(lhs, rhs);
   pop();
   pop();
   push(OBJ_VAL(obj));
+  return true;
 }
 
-static void numberToString() {
-  Value rhs = peek(0);
-  Value lhs = peek(1);
-  ObjString *string = NULL;
-  double number = 0;
-
-  if (IS_STRING(rhs)) {
-    string = AS_STRING(rhs);
-    number = AS_NUMBER(lhs);
-  } else {
-    string = AS_STRING(lhs);
-    number = AS_NUMBER(rhs);
-  }
-
-  // Buffer for the number conversion
+// the number operand is replaced with its string form in place, so the
+// concatenation below sees two strings
+static bool numberToString() {
+  int numberSlot = IS_NUMBER(peek(0)) ? 0 : 1;
   char numberStr[32];
-  int numberLen = snprintf(numberStr, sizeof(numberStr), "%.14g", number);
-
-  // Calculate total length
-  int totalLen = string->length + numberLen;
-
-  // Allocate new buffer for concatenated string
-  char *newString = ALLOCATE(char, totalLen + 1); // +1 for null terminator
-
-  if (IS_STRING(rhs)) {
-    // Copy the existing string
-    memcpy(newString, numberStr, numberLen);
+  int numberLen =
+      snprintf(numberStr, sizeof(numberStr), "%.14g", AS_NUMBER(peek(numberSlot)));
+  ObjString *string = copyRuntimeString(numberStr, numberLen);
+  vm.stackTop[-1 - numberSlot] = OBJ_VAL(string);
+  return concatenate();
+}
 
-    // Copy the number string
-    memcpy(newString + numberLen, string->chars, string->length);
+// slow path of OP_ADD for everything but two numbers, the operands are on
+// top of the stack
+static bool addObjects() {
+  bool fits;
+  if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+    fits = concatenate();
+  } else if (IS_NUMBER(peek(0)) && IS_STRING(peek(1)) ||
+             IS_STRING(peek(0)) && IS_NUMBER(peek(1))) {
+    fits = numberToString();
   } else {
-    // Copy the existing string
-    memcpy(newString, string->chars, string->length);
-
-    // Copy the number string
-    memcpy(newString + string->length, numberStr, numberLen);
+    runtimeError("Operands must be two numbers or two strings.");
+    return false;
   }
-  // Null terminate the string
-  newString[totalLen] = '\0';
-
-  ObjString *obj = takeString(newString, totalLen);
-  pop();
-  pop();
-  push(OBJ_VAL(obj));
+  if (!fits) {
+    runtimeError("String too long.");
+    return false;
+  }
+  return true;
 }
 
 void initVm() {
   vm.bytesAllocated = 0;
-  vm.nextGC = 1024 * 1024;
+  vm.nextGC = GC_MIN_HEAP;
+  vm.gcGrowth = 2;
+  vm.gcTarget = GC_TARGET_PERCENT / 100.0;
+  vm.gcPacedAt = 0;
+  vm.gcPacedCost = 0;
+  vm.heapLimit = 0;
+  vm.heapExhausted = false;
+  vm.gcEnabled = true;
   vm.objectHeap = NULL;
   vm.grayCap = 0;
   vm.grayCount = 0;
   vm.grayStack = NULL;
+#ifdef GENERATIONAL_GC
+  vm.nursery = NULL;
+  vm.allocateYoung = false;
+  vm.rememberedCap = 0;
+  vm.rememberedCount = 0;
+  vm.rememberedObjects = NULL;
+  vm.rememberedGlobalCap = 0;
+  vm.rememberedGlobalCount = 0;
+  vm.rememberedGlobals = NULL;
+  vm.youngStringCap = 0;
+  vm.youngStringCount = 0;
+  vm.youngStrings = NULL;
+#endif
+#if defined(GENERATIONAL_GC) || defined(COMPACTING_GC)
+  vm.gcRequested = false;
+#endif
+#ifdef COMPACTING_GC
+  vm.compactRequested = false;
+#endif
+#if defined(INCREMENTAL_GC) || defined(LAZY_SWEEP)
+  vm.sweepList = NULL;
+#endif
+#ifdef INCREMENTAL_GC
+  vm.gcPhase = GC_IDLE;
+  vm.gcSliceBudget = GC_SLICE_BUDGET;
+#endif
+#ifdef CONCURRENT_GC
+  vm.markConcurrently = false;
+#endif
+  initMetrics(&vm.metrics);
+  vm.countMode = COUNT_OFF;
+#ifdef PARALLEL_GC
+  // one mark worker per core by default
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  vm.gcThreads = cores < 1 ? 1 : cores > GC_MAX_THREADS ? GC_MAX_THREADS : cores;
+#endif
+  vm.frames = NULL;
+  vm.frameCount = 0;
+  vm.frameCapacity = 0;
+  vm.maxFrames = FRAMES_MAX;
+  vm.stackCapacity = STACK_INITIAL;
+  vm.stack = ALLOCATE(Value, vm.stackCapacity);
   resetStack();
-  initHashTable(&vm.stringsPool);
-  initHashTable(&vm.globals);
+  initStringSet(&vm.stringsPool);
+  initHashTable(&vm.globalSlots);
+  initValueArray(&vm.globalNames);
+  initValueArray(&vm.globalValues);
 
   defineNative("clock", clockNative);
+  defineNative("gcCollect", gcCollectNative);
+  defineNative("gcDisable", gcDisableNative);
+  defineNative("gcEnable", gcEnableNative);
+  defineNative("heapSize", heapSizeNative);
+  defineNative("vmStats", vmStatsNative);
 }
-#ifdef DEBUG_LOG_STATS_GC
-static void printRemainingObjects() {
-  for (Obj *cur = vm.objectHeap; cur != NULL; cur = cur->next) {
-    printf("heap obj: ");
-    printObject(cur);
-    printf("\n");
-  }
-}
-#endif
+
 void freeVm() {
   freeObjectPool();
-  freeHashTable(&vm.stringsPool);
-  freeHashTable(&vm.globals);
-#ifdef DEBUG_LOG_STATS_GC
-  printf("-- free vm: %zu\n", vm.bytesAllocated);
+  freeStringSet(&vm.stringsPool);
+  freeHashTable(&vm.globalSlots);
+  freeValueArray(&vm.globalNames);
+  freeValueArray(&vm.globalValues);
+  FREE_ARRAY(CallFrame, vm.frames, vm.frameCapacity);
+  FREE_ARRAY(Value, vm.stack, vm.stackCapacity);
+#ifdef SLAB_ALLOCATOR
+  freeSlabs();
 #endif
 }
 
 InterpritationResult static run() {
   CallFrame *frame = &vm.frames[vm.frameCount - 1];
-#define READ_BYTE() (*frame->ip++)
-#define READ_CONSTANT()                                                        \
-  (frame->closure->function->chunk.constants.values[READ_BYTE()])
-#define READ_STRING() AS_STRING(READ_CONSTANT())
-#define READ_SHORT()                                                           \
-  (frame->ip += 2, (uint16_t)(frame->ip[-2] << 8 | frame->ip[-1]))
+  // hot interpreter state lives in locals, it is written back to the frame
+  // only when someone else needs to see it: calls, returns and errors
+  uint8_t *ip = frame->ip;
+  Value *slots = frame->slots;
+  Value *constants = frame->closure->function->chunk.constants.values;
+  // kept in a register and added to the metrics whenever the frame is stored
+  uint64_t executed = 0;
+
+#define READ_BYTE() (*ip++)
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_SHORT() (ip += 2, (uint16_t)(ip[-2] << 8 | ip[-1]))
+#define STORE_FRAME()                                                          \
+  (frame->ip = ip, vm.metrics.instructions += executed, executed = 0)
+#define LOAD_FRAME()                                                           \
+  do {                                                                         \
+    frame = &vm.frames[vm.frameCount - 1];                                     \
+    ip = frame->ip;                                                            \
+    slots = frame->slots;                                                      \
+    constants = frame->closure->function->chunk.constants.values;              \
+  } while (false)
+#define RUNTIME_ERROR(...)                                                     \
+  do {                                                                         \
+    STORE_FRAME();                                                             \
+    runtimeError(__VA_ARGS__);                                                 \
+    return INTERPRET_RUNTIME_ERROR;                                            \
+  } while (false)
 #define BINARY_OP(valueType, op)                                               \
   do {                                                                         \
     if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {                          \
-      runtimeError("Operands must be numbers.");                               \
-      return INTERPRET_RUNTIME_ERROR;                                          \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
     }                                                                          \
     double b = AS_NUMBER(pop());                                               \
     double a = AS_NUMBER(pop());                                               \
     push(valueType(a op b));                                                   \
   } while (false)
+// quickening: a generic instruction rewrites itself into the form
+// specialized for the operand types it has just seen
+#define QUICKEN(specialized) (ip[-1] = (specialized))
+// the specialized instruction met operands its guard does not accept, the
+// generic one is put back and executed, it specializes again for the new
+// types, it runs without a dispatch so the instruction is counted once
+#define DEOPTIMIZE(generic)                                                    \
+  do {                                                                         \
+    ip[-1] = (generic);                                                        \
+    EXECUTE(generic);                                                          \
+  } while (false)
+// pops both operands and jumps when the comparison does not hold
+#define COMPARE_JUMP(test)                                                     \
+  do {                                                                         \
+    uint16_t offset = READ_SHORT();                                            \
+    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {                          \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
+    }                                                                          \
+    double b = AS_NUMBER(pop());                                               \
+    double a = AS_NUMBER(pop());                                               \
+    if (!(test)) {                                                             \
+      ip += offset;                                                            \
+    }                                                                          \
+  } while (false)
+
+#if defined(GENERATIONAL_GC) || defined(COMPACTING_GC)
+// minor collections and compactions move objects, so they only run here,
+// where every live object is reachable from the stack, the frames, the
+// globals or the remembered set, the frame locals are reloaded afterwards
+#define COLLECT_AT_SAFEPOINT()                                                 \
+  do {                                                                         \
+    if (vm.gcRequested) {                                                      \
+      STORE_FRAME();                                                           \
+      collectAtSafepoint();                                                    \
+      LOAD_FRAME();                                                            \
+    }                                                                          \
+  } while (false)
+#else
+#define COLLECT_AT_SAFEPOINT()                                                 \
+  do {                                                                         \
+  } while (false)
+#endif
+
+// loops, calls and returns, a script over the heap limit is stopped here
+// with the allocations it was in the middle of complete, profiler ticks are
+// sampled here too
+#define SAFEPOINT()                                                            \
+  do {                                                                         \
+    COLLECT_AT_SAFEPOINT();                                                    \
+    if (vm.heapExhausted && isHeapExhausted()) {                               \
+      RUNTIME_ERROR("Out of memory, the heap is limited to %zu bytes.",        \
+                    vm.heapLimit);                                             \
+    }                                                                          \
+    if (isSamplePending()) {                                                   \
+      STORE_FRAME();                                                           \
+      takeSample();                                                            \
+    }                                                                          \
+  } while (false)
 
-  uint8_t instruction;
-  for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
-    printf("          ");
-    for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
-      printf("[ ");
-      printValue(*slot);
-      printf(" ]");
-    }
-    printf("\n");
-    disassembleInstruction(
-        &frame->closure->function->chunk,
-        (int)(frame->ip - frame->closure->function->chunk.code));
+#define TRACE_INSTRUCTION()                                                    \
+  do {                                                                         \
+    printf("          ");                                                      \
+    for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {                 \
+      printf("[ ");                                                            \
+      printValue(*slot);                                                       \
+      printf(" ]");                                                            \
+    }                                                                          \
+    printf("\n");                                                              \
+    disassembleInstruction(                                                    \
+        &frame->closure->function->chunk,                                      \
+        (int)(ip - frame->closure->function->chunk.code));                     \
+  } while (false)
+#else
+#define TRACE_INSTRUCTION()                                                    \
+  do {                                                                         \
+  } while (false)
+#endif
+
+#ifdef COMPUTED_GOTO
+  // every handler jumps straight to the next one through this table, so each
+  // opcode gets its own indirect branch instead of sharing the switch one
+  static void *handlerTable[] = {
+      [OP_RETURN] = &&op_RETURN,
+      [OP_CONSTANT] = &&op_CONSTANT,
+      [OP_NEGATE] = &&op_NEGATE,
+      [OP_ADD] = &&op_ADD,
+      [OP_SUBTRACT] = &&op_SUBTRACT,
+      [OP_MULT] = &&op_MULT,
+      [OP_DIVIDE] = &&op_DIVIDE,
+      [OP_NIL] = &&op_NIL,
+      [OP_FALSE] = &&op_FALSE,
+      [OP_TRUE] = &&op_TRUE,
+      [OP_NOT] = &&op_NOT,
+      [OP_EQUAL] = &&op_EQUAL,
+      [OP_GREATER] = &&op_GREATER,
+      [OP_LESS] = &&op_LESS,
+      [OP_PRINT] = &&op_PRINT,
+      [OP_POP] = &&op_POP,
+      [OP_DEFINE_GLOBAL] = &&op_DEFINE_GLOBAL,
+      [OP_GET_GLOBAL] = &&op_GET_GLOBAL,
+      [OP_SET_GLOBAL] = &&op_SET_GLOBAL,
+      [OP_GET_LOCAL] = &&op_GET_LOCAL,
+      [OP_SET_LOCAL] = &&op_SET_LOCAL,
+      [OP_JUMP] = &&op_JUMP,
+      [OP_JUMP_IF_FALSE] = &&op_JUMP_IF_FALSE,
+      [OP_LOOP] = &&op_LOOP,
+      [OP_CALL] = &&op_CALL,
+      [OP_CLOSURE] = &&op_CLOSURE,
+      [OP_GET_UPVALUE] = &&op_GET_UPVALUE,
+      [OP_SET_UPVALUE] = &&op_SET_UPVALUE,
+      [OP_CLOSE_UPVALUE] = &&op_CLOSE_UPVALUE,
+      [OP_TAIL_CALL] = &&op_TAIL_CALL,
+      [OP_NOT_EQUAL] = &&op_NOT_EQUAL,
+      [OP_LESS_EQUAL] = &&op_LESS_EQUAL,
+      [OP_GREATER_EQUAL] = &&op_GREATER_EQUAL,
+      [OP_POP_JUMP_IF_FALSE] = &&op_POP_JUMP_IF_FALSE,
+      [OP_JUMP_IF_NOT_EQUAL] = &&op_JUMP_IF_NOT_EQUAL,
+      [OP_JUMP_IF_EQUAL] = &&op_JUMP_IF_EQUAL,
+      [OP_JUMP_IF_NOT_LESS] = &&op_JUMP_IF_NOT_LESS,
+      [OP_JUMP_IF_NOT_LESS_EQUAL] = &&op_JUMP_IF_NOT_LESS_EQUAL,
+      [OP_JUMP_IF_NOT_GREATER] = &&op_JUMP_IF_NOT_GREATER,
+      [OP_JUMP_IF_NOT_GREATER_EQUAL] = &&op_JUMP_IF_NOT_GREATER_EQUAL,
+      [OP_GET_LOCAL_2] = &&op_GET_LOCAL_2,
+      [OP_ADD_LOCAL_CONST] = &&op_ADD_LOCAL_CONST,
+      [OP_SUBTRACT_LOCAL_CONST] = &&op_SUBTRACT_LOCAL_CONST,
+      [OP_ADD_NUM] = &&op_ADD_NUM,
+      [OP_ADD_STR] = &&op_ADD_STR,
+      [OP_EQUAL_NUM] = &&op_EQUAL_NUM,
+  };
+  // with --count every opcode goes through count_instruction first, the
+  // handlers themselves are the same
+  static void *dispatchTable[OP_COUNT];
+  for (int i = 0; i < OP_COUNT; i++) {
+    dispatchTable[i] =
+        vm.countMode != COUNT_OFF ? &&count_instruction : handlerTable[i];
+  }
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    TRACE_INSTRUCTION();                                                       \
+    executed++;                                                                \
+    goto *dispatchTable[instruction = READ_BYTE()];                            \
+  } while (false)
+// runs the handler of an opcode already read and counted
+#define EXECUTE(opcode) goto *handlerTable[opcode]
+#define CASE(name) op_##name
+#define INTERPRET_LOOP DISPATCH();
+#else
+#define DISPATCH() goto loop
+#define EXECUTE(opcode)                                                        \
+  do {                                                                         \
+    instruction = (opcode);                                                    \
+    goto execute;                                                              \
+  } while (false)
+#define CASE(name) case OP_##name
+#define INTERPRET_LOOP                                                         \
+  loop:                                                                        \
+  TRACE_INSTRUCTION();                                                         \
+  executed++;                                                                  \
+  if (counting) {                                                              \
+    countInstruction(&frame->closure->function->chunk, ip);                    \
+  }                                                                            \
+  instruction = READ_BYTE();                                                   \
+  execute:                                                                     \
+  switch (instruction)
+#endif
+
+  uint8_t instruction;
+#ifndef COMPUTED_GOTO
+  bool counting = vm.countMode != COUNT_OFF;
+#endif
+  INTERPRET_LOOP {
+#ifdef COMPUTED_GOTO
+  count_instruction:
+    countInstruction(&frame->closure->function->chunk, ip - 1);
+    // reading instruction here would keep it alive across every handler,
+    // that slows the loop down even when nothing is counted
+    goto *handlerTable[ip[-1]];
 #endif
-    switch (instruction = READ_BYTE()) {
-    case OP_RETURN: {
+    CASE(RETURN): {
+      SAFEPOINT();
       Value result = pop();
-      closeUpvalues(frame->slots);
+      closeUpvalues(slots);
       vm.frameCount--;
       if (vm.frameCount == 0) {
         pop();
+        vm.metrics.instructions += executed;
         return INTERPRET_OK;
       }
 
-      vm.stackTop = frame->slots;
+      vm.stackTop = slots;
       push(result);
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
+      LOAD_FRAME();
+      DISPATCH();
     }
-    case OP_NEGATE: {
+    CASE(NEGATE): {
       if (!IS_NUMBER(peek(0))) {
-        runtimeError("Operand must be a number.");
-        return INTERPRET_RUNTIME_ERROR;
+        RUNTIME_ERROR("Operand must be a number.");
       }
       push(NUMBER_VAL(-AS_NUMBER(pop())));
-      break;
+      DISPATCH();
     }
-    case OP_ADD: {
-      if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-        concatenate();
-      } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+    CASE(ADD): {
+      if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+        QUICKEN(OP_ADD_NUM);
         double rhs = AS_NUMBER(pop());
         double lhs = AS_NUMBER(pop());
         push(NUMBER_VAL(lhs + rhs));
-      } else if (IS_NUMBER(peek(0)) && IS_STRING(peek(1)) ||
-                 IS_STRING(peek(0)) && IS_NUMBER(peek(1))) {
-        numberToString();
-      } else {
-        runtimeError("Operands must be two numbers or two strings.");
+        DISPATCH();
+      }
+      if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+        QUICKEN(OP_ADD_STR);
+        if (!concatenate()) {
+          RUNTIME_ERROR("String too long.");
+        }
+        DISPATCH();
+      }
+      STORE_FRAME();
+      if (!addObjects()) {
         return INTERPRET_RUNTIME_ERROR;
       }
-
-      break;
+      DISPATCH();
     }
-    case OP_NOT: {
+    CASE(NOT): {
       push(BOOL_VAL(isFalsey(pop())));
-      break;
+      DISPATCH();
     }
-    case OP_EQUAL: {
-      Value b = pop();
-      Value a = pop();
-      push(BOOL_VAL(valuesEqual(a, b)));
-      break;
+    CASE(EQUAL): {
+      if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
+        QUICKEN(OP_EQUAL_NUM);
+      }
+      // comparing ropes flattens them, the operands stay on the stack until
+      // that is done
+      bool equal = valuesEqual(peek(1), peek(0));
+      pop();
+      pop();
+      push(BOOL_VAL(equal));
+      DISPATCH();
     }
-    case OP_GREATER:
+    CASE(GREATER): {
       BINARY_OP(BOOL_VAL, >);
-      break;
-    case OP_LESS:
+      DISPATCH();
+    }
+    CASE(LESS): {
       BINARY_OP(BOOL_VAL, <);
-      break;
-    case OP_SUBTRACT: {
+      DISPATCH();
+    }
+    CASE(SUBTRACT): {
       BINARY_OP(NUMBER_VAL, -);
-      break;
+      DISPATCH();
     }
-    case OP_NIL:
+    CASE(NIL): {
       push(NIL_VAL);
-      break;
-    case OP_TRUE:
+      DISPATCH();
+    }
+    CASE(TRUE): {
       push(BOOL_VAL(true));
-      break;
-    case OP_FALSE:
+      DISPATCH();
+    }
+    CASE(FALSE): {
       push(BOOL_VAL(false));
-      break;
-    case OP_MULT: {
+      DISPATCH();
+    }
+    CASE(MULT): {
       BINARY_OP(NUMBER_VAL, *);
-      break;
+      DISPATCH();
     }
-    case OP_DIVIDE: {
+    CASE(DIVIDE): {
       BINARY_OP(NUMBER_VAL, /);
-      break;
+      DISPATCH();
     }
-    case OP_CONSTANT: {
+    CASE(CONSTANT): {
       Value constant = READ_CONSTANT();
       push(constant);
-      break;
+      DISPATCH();
     }
-    case OP_PRINT: {
-      printValue(pop());
+    CASE(PRINT): {
+      // printing flattens ropes, so the value is popped afterwards
+      printValue(peek(0));
       printf("\n");
-      break;
-    }
-    case OP_POP: {
       pop();
-      break;
+      DISPATCH();
     }
-    case OP_DEFINE_GLOBAL: {
-      ObjString *name = READ_STRING();
-      setTableValue(&vm.globals, name, peek(0));
-      // pop variable value
+    CASE(POP): {
       pop();
-      break;
+      DISPATCH();
     }
-    case OP_GET_GLOBAL: {
-      ObjString *name = READ_STRING();
-      Value variableValue;
-      if (!getTableValue(&vm.globals, name, &variableValue)) {
-        runtimeError("Undefined variable '%s'.", name->chars);
-        return INTERPRET_RUNTIME_ERROR;
+    CASE(DEFINE_GLOBAL): {
+      uint16_t slot = READ_SHORT();
+      GLOBAL_WRITE_BARRIER(slot, vm.globalValues.values[slot], peek(0));
+      vm.globalValues.values[slot] = pop();
+      DISPATCH();
+    }
+    CASE(GET_GLOBAL): {
+      uint16_t slot = READ_SHORT();
+      Value variableValue = vm.globalValues.values[slot];
+      if (IS_UNDEFINED(variableValue)) {
+        RUNTIME_ERROR("Undefined variable '%s'.",
+                      AS_CSTRING(vm.globalNames.values[slot]));
       }
       push(variableValue);
-      break;
+      DISPATCH();
     }
-    case OP_SET_GLOBAL: {
-      ObjString *name = READ_STRING();
-      Value variableValue;
-      if (!getTableValue(&vm.globals, name, &variableValue)) {
-        runtimeError("Undefined variable '%s'.", name->chars);
-        return INTERPRET_RUNTIME_ERROR;
+    CASE(SET_GLOBAL): {
+      uint16_t slot = READ_SHORT();
+      Value *variable = &vm.globalValues.values[slot];
+      if (IS_UNDEFINED(*variable)) {
+        RUNTIME_ERROR("Undefined variable '%s'.",
+                      AS_CSTRING(vm.globalNames.values[slot]));
       }
-      setTableValue(&vm.globals, name, peek(0));
-      break;
+      GLOBAL_WRITE_BARRIER(slot, *variable, peek(0));
+      *variable = peek(0);
+      DISPATCH();
     }
-    case OP_GET_LOCAL: {
+    CASE(GET_LOCAL): {
       uint8_t slot = READ_BYTE();
-      push(frame->slots[slot]);
-      break;
+      push(slots[slot]);
+      DISPATCH();
     }
-    case OP_SET_LOCAL: {
+    CASE(SET_LOCAL): {
       uint8_t slot = READ_BYTE();
-      frame->slots[slot] = peek(0);
-      break;
+      slots[slot] = peek(0);
+      DISPATCH();
     }
-    case OP_JUMP_IF_FALSE: {
+    CASE(JUMP_IF_FALSE): {
       uint16_t offset = READ_SHORT();
       if (isFalsey(peek(0))) {
-        frame->ip += offset;
+        ip += offset;
       }
-      break;
+      DISPATCH();
     }
-    case OP_JUMP: {
+    CASE(JUMP): {
       uint16_t offset = READ_SHORT();
-      frame->ip += offset;
-      break;
+      ip += offset;
+      DISPATCH();
     }
-    case OP_LOOP: {
+    CASE(LOOP): {
       uint16_t offset = READ_SHORT();
-      frame->ip -= offset;
-      break;
+      // before the jump, ip - 1 is still part of the loop instruction, so a
+      // sample or an error is reported on its line
+      SAFEPOINT();
+      ip -= offset;
+      DISPATCH();
     }
-    case OP_CALL: {
+    CASE(CALL): {
       int argCount = READ_BYTE();
+      SAFEPOINT();
+      STORE_FRAME();
       if (!callValue(peek(argCount), argCount)) {
         return INTERPRET_RUNTIME_ERROR;
       }
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
+      LOAD_FRAME();
+      DISPATCH();
+    }
+    CASE(TAIL_CALL): {
+      int argCount = READ_BYTE();
+      SAFEPOINT();
+      Value callee = peek(argCount);
+      STORE_FRAME();
+      // natives get a plain call, the OP_RETURN that follows returns the
+      // result
+      if (IS_CLOSURE(callee)) {
+        if (!tailCall(AS_CLOSURE(callee), argCount)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+      } else if (!callValue(callee, argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      LOAD_FRAME();
+      DISPATCH();
     }
-    case OP_CLOSURE: {
+    CASE(CLOSURE): {
       ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
       ObjClosure *closure = newClosure(function);
       push(OBJ_VAL(closure));
       for (int i = 0; i < closure->upvalueCount; i++) {
         uint8_t isLocal = READ_BYTE();
         uint8_t index = READ_BYTE();
-        if (isLocal) {
-          closure->upvalues[i] = captureUpvalue(frame->slots + index);
-        } else {
-          closure->upvalues[i] = frame->closure->upvalues[index];
-        }
+        ObjUpvalue *upvalue = isLocal ? captureUpvalue(slots + index)
+                                      : frame->closure->upvalues[index];
+        WRITE_BARRIER(&closure->obj, OBJ_VAL(upvalue));
+        closure->upvalues[i] = upvalue;
       }
-      break;
+      DISPATCH();
     }
-    case OP_GET_UPVALUE: {
+    CASE(GET_UPVALUE): {
       uint8_t index = READ_BYTE();
       push(*frame->closure->upvalues[index]->location);
-      break;
+      DISPATCH();
     }
-    case OP_SET_UPVALUE: {
+    CASE(SET_UPVALUE): {
       uint8_t index = READ_BYTE();
-      *frame->closure->upvalues[index]->location = peek(0);
-      break;
+      ObjUpvalue *upvalue = frame->closure->upvalues[index];
+      WRITE_BARRIER(&upvalue->obj, peek(0));
+      OVERWRITE_BARRIER(*upvalue->location);
+      *upvalue->location = peek(0);
+      DISPATCH();
     }
-    case OP_CLOSE_UPVALUE: {
+    CASE(CLOSE_UPVALUE): {
       closeUpvalues(vm.stackTop - 1);
       pop();
-      break;
+      DISPATCH();
+    }
+    CASE(NOT_EQUAL): {
+      bool equal = valuesEqual(peek(1), peek(0));
+      pop();
+      pop();
+      push(BOOL_VAL(!equal));
+      DISPATCH();
+    }
+    CASE(LESS_EQUAL): {
+      // spelled as !(a > b) to keep the NaN behaviour of GREATER, NOT
+      if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+        RUNTIME_ERROR("Operands must be numbers.");
+      }
+      double b = AS_NUMBER(pop());
+      double a = AS_NUMBER(pop());
+      push(BOOL_VAL(!(a > b)));
+      DISPATCH();
+    }
+    CASE(GREATER_EQUAL): {
+      if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+        RUNTIME_ERROR("Operands must be numbers.");
+      }
+      double b = AS_NUMBER(pop());
+      double a = AS_NUMBER(pop());
+      push(BOOL_VAL(!(a < b)));
+      DISPATCH();
+    }
+    CASE(POP_JUMP_IF_FALSE): {
+      uint16_t offset = READ_SHORT();
+      if (isFalsey(pop())) {
+        ip += offset;
+      }
+      DISPATCH();
+    }
+    CASE(JUMP_IF_NOT_EQUAL): {
+      uint16_t offset = READ_SHORT();
+      bool equal = valuesEqual(peek(1), peek(0));
+      pop();
+      pop();
+      if (!equal) {
+        ip += offset;
+      }
+      DISPATCH();
+    }
+    CASE(JUMP_IF_EQUAL): {
+      uint16_t offset = READ_SHORT();
+      bool equal = valuesEqual(peek(1), peek(0));
+      pop();
+      pop();
+      if (equal) {
+        ip += offset;
+      }
+      DISPATCH();
+    }
+    CASE(JUMP_IF_NOT_LESS): {
+      COMPARE_JUMP(a < b);
+      DISPATCH();
+    }
+    CASE(JUMP_IF_NOT_LESS_EQUAL): {
+      COMPARE_JUMP(!(a > b));
+      DISPATCH();
+    }
+    CASE(JUMP_IF_NOT_GREATER): {
+      COMPARE_JUMP(a > b);
+      DISPATCH();
+    }
+    CASE(JUMP_IF_NOT_GREATER_EQUAL): {
+      COMPARE_JUMP(!(a < b));
+      DISPATCH();
     }
+    CASE(GET_LOCAL_2): {
+      push(slots[READ_BYTE()]);
+      push(slots[READ_BYTE()]);
+      DISPATCH();
+    }
+    CASE(ADD_LOCAL_CONST): {
+      Value local = slots[READ_BYTE()];
+      Value constant = READ_CONSTANT();
+      if (IS_NUMBER(local)) {
+        push(NUMBER_VAL(AS_NUMBER(local) + AS_NUMBER(constant)));
+        DISPATCH();
+      }
+      // string + number keeps the generic OP_ADD behaviour
+      push(local);
+      push(constant);
+      STORE_FRAME();
+      if (!addObjects()) {
+        return INTERPRET_RUNTIME_ERROR;
+      }
+      DISPATCH();
+    }
+    CASE(ADD_NUM): {
+      if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+        DEOPTIMIZE(OP_ADD);
+      }
+      double rhs = AS_NUMBER(pop());
+      double lhs = AS_NUMBER(pop());
+      push(NUMBER_VAL(lhs + rhs));
+      DISPATCH();
+    }
+    CASE(ADD_STR): {
+      if (!IS_STRING(peek(0)) || !IS_STRING(peek(1))) {
+        DEOPTIMIZE(OP_ADD);
+      }
+      if (!concatenate()) {
+        RUNTIME_ERROR("String too long.");
+      }
+      DISPATCH();
+    }
+    CASE(EQUAL_NUM): {
+      if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {
+        DEOPTIMIZE(OP_EQUAL);
+      }
+      double b = AS_NUMBER(pop());
+      double a = AS_NUMBER(pop());
+      push(BOOL_VAL(a == b));
+      DISPATCH();
+    }
+    CASE(SUBTRACT_LOCAL_CONST): {
+      Value local = slots[READ_BYTE()];
+      Value constant = READ_CONSTANT();
+      if (!IS_NUMBER(local)) {
+        RUNTIME_ERROR("Operands must be numbers.");
+      }
+      push(NUMBER_VAL(AS_NUMBER(local) - AS_NUMBER(constant)));
+      DISPATCH();
     }
   }
+
+  // unknown opcode, the compiler never emits one
+  return INTERPRET_RUNTIME_ERROR;
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
+#undef TRACE_INSTRUCTION
+#undef SAFEPOINT
+#undef COMPARE_JUMP
+#undef DEOPTIMIZE
+#undef EXECUTE
+#undef QUICKEN
 #undef BINARY_OP
+#undef RUNTIME_ERROR
+#undef LOAD_FRAME
+#undef STORE_FRAME
 #undef READ_BYTE
 #undef READ_CONSTANT
-#undef READ_STRING
 #undef READ_SHORT
 }
 
 InterpritationResult interpret(char *source) {
+  double compileStart = metricsClock();
+  double scanBefore = vm.metrics.scanTime;
   ObjFunction *function = compile(source);
+  vm.metrics.compileTime += metricsClock() - compileStart -
+                            (vm.metrics.scanTime - scanBefore);
   if (function == NULL) {
     return INTERPRET_COMPILE_ERROR;
   }
+  // the function stays below the frame of the script, so it is still found,
+  // and forwarded if a collection moves it, once the script has finished
   push(OBJ_VAL(function));
 
   ObjClosure *closure = newClosure(function);
-  pop();
   push(OBJ_VAL(closure));
 
   call(closure, 0);
 
+  double runStart = metricsClock();
+#ifdef GENERATIONAL_GC
+  vm.allocateYoung = true;
+  InterpritationResult res = run();
+  vm.allocateYoung = false;
+#elif defined(CONCURRENT_GC)
+  vm.markConcurrently = true;
+  InterpritationResult res = run();
+  vm.markConcurrently = false;
+#else
   InterpritationResult res = run();
-  runGc();
-#ifdef DEBUG_LOG_STATS_GC
-  printRemainingObjects();
-  printf("-- last gc: %zu\n", vm.bytesAllocated);
 #endif
+  vm.metrics.runTime += metricsClock() - runStart;
+  // a runtime error resets the stack but leaves its slots as they were
+  function = AS_FUNCTION(vm.stack[0]);
+  if (vm.countMode != COUNT_OFF) {
+    printInstructionCounts(function);
+  }
+  vm.stackTop = vm.stack;
+  runGc();
   return res;
 }
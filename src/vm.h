@@ -4,13 +4,18 @@
 #include "chunk.h"
 #include "compiler.h"
 #include "hash_table.h"
+#include "instruction_counts.h"
+#include "metrics.h"
 #include "object.h"
+#include "string_set.h"
 #include "value.h"
 #include <stddef.h>
 #include <stdint.h>
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// default limit on the call depth, change it with --max-frames
+#define FRAMES_MAX 100000
+// slots the stack starts with, it grows on a call whose function needs more
+#define STACK_INITIAL (UINT8_COUNT * 2)
 
 typedef struct {
   ObjClosure *closure;
@@ -20,17 +25,82 @@ typedef struct {
   Value *slots;
 } CallFrame;
 
+#ifdef INCREMENTAL_GC
+typedef enum { GC_IDLE, GC_MARK, GC_SWEEP } GcPhase;
+#endif
+
+#ifdef GENERATIONAL_GC
+typedef struct NurseryBlock {
+  struct NurseryBlock *next;
+  size_t used;
+  _Alignas(16) uint8_t data[];
+} NurseryBlock;
+#endif
+
+// objects are kept in segments of at most HEAP_SEGMENT_OBJECTS, each with its
+// own intrusive list through the object headers, so the heap can be swept one
+// segment at a time or by several threads at once
+#define HEAP_SEGMENT_OBJECTS 1024
+
+typedef struct HeapSegment {
+  struct HeapSegment *next;
+  Obj *objects;
+  int count;
+} HeapSegment;
+
 typedef struct {
-  CallFrame frames[FRAMES_MAX];
+  // both arrays grow on demand in call(), growing the stack moves it, so
+  // frame slots and open upvalues are rebased onto the new block
+  CallFrame *frames;
   int frameCount;
+  int frameCapacity;
+  int maxFrames;
 
-  Value stack[STACK_MAX];
+  Value *stack;
   Value *stackTop;
+  int stackCapacity;
+
+  StringSet stringsPool;
 
-  HashTable stringsPool;
-  HashTable globals;
+  // globals are resolved to slots at compile time: globalSlots maps a name
+  // to its index in globalValues, globalNames maps the index back for errors
+  HashTable globalSlots;
+  ValueArray globalNames;
+  ValueArray globalValues;
 
-  Obj *objectHeap;
+  // new objects go to the first segment
+  HeapSegment *objectHeap;
+
+#ifdef GENERATIONAL_GC
+  // objects are bump allocated into the newest block while allocateYoung is
+  // set, that is while run() executes, everything else goes straight into
+  // objectHeap
+  NurseryBlock *nursery;
+  bool allocateYoung;
+#endif
+#if defined(GENERATIONAL_GC) || defined(COMPACTING_GC)
+  // set once the nursery spills into a second block or the heap passes
+  // nextGC, or a compaction is due, the next safepoint in run() collects
+  bool gcRequested;
+#endif
+#ifdef COMPACTING_GC
+  // the last full collection left the slabs fragmented
+  bool compactRequested;
+#endif
+#ifdef GENERATIONAL_GC
+  // old objects and global slots that were given a young reference since the
+  // last minor collection
+  int rememberedCap;
+  int rememberedCount;
+  Obj **rememberedObjects;
+  int rememberedGlobalCap;
+  int rememberedGlobalCount;
+  int *rememberedGlobals;
+  // interned strings still in the nursery, the pool holds them weakly
+  int youngStringCap;
+  int youngStringCount;
+  ObjString **youngStrings;
+#endif
 
   ObjUpvalue *openUpvalues;
   int grayCap;
@@ -39,6 +109,48 @@ typedef struct {
 
   size_t bytesAllocated;
   size_t nextGC;
+  // growth of the heap allowed between full collections, adapted to keep
+  // the collector near gcTarget, a fraction of the run time
+  double gcGrowth;
+  double gcTarget;
+  // when the growth was last adapted and the collector time up to then
+  double gcPacedAt;
+  double gcPacedCost;
+  // hard cap on bytesAllocated, 0 for none, set with --heap-limit or
+  // CLOX_HEAP_LIMIT, going over it collects everything and stops the script
+  // at the next safepoint if that was not enough
+  size_t heapLimit;
+  bool heapExhausted;
+  // cleared by the gcDisable() native, allocations stop starting full
+  // collections until gcEnable(), the heap limit still applies and a spilled
+  // nursery is still collected
+  bool gcEnabled;
+
+#ifdef INCREMENTAL_GC
+  GcPhase gcPhase;
+#endif
+#if defined(INCREMENTAL_GC) || defined(LAZY_SWEEP)
+  // segments of the last marking the sweeper has not reached yet, new objects
+  // go to objectHeap so they are never swept by the cycle that was running
+  // when they were made
+  HeapSegment *sweepList;
+#endif
+#ifdef INCREMENTAL_GC
+  // gray objects traced or objects swept by one slice, set with --gc-slice
+  int gcSliceBudget;
+#endif
+#ifdef CONCURRENT_GC
+  // the compiler changes functions in place, so the helper thread only marks
+  // while run() executes, collections during compilation stop the world
+  bool markConcurrently;
+#endif
+#ifdef PARALLEL_GC
+  // threads marking during a full collection, set with --gc-threads
+  int gcThreads;
+#endif
+
+  Metrics metrics;
+  CountMode countMode;
 } VM;
 
 typedef enum {
@@ -53,6 +165,7 @@ void initVm();
 void freeVm();
 
 InterpritationResult interpret(char *source);
+int resolveGlobal(ObjString *name);
 
 void push(Value value);
 Value pop();